@@ -0,0 +1,114 @@
+#include <Arduino.h>
+#include <Ticker.h>
+#include "defines.hpp"
+
+#define LIGHT_SAMPLE_MS 50
+#define PWM_RANGE 1023
+// light levels are 10 bit, the table is indexed by the top 8
+#define DUTY_LUT_SIZE 256
+
+namespace cx {
+  constexpr double ln2 = 0.6931471805599453;
+
+  // natural log, scaled into [0.5, 1) so the atanh series converges fast
+  constexpr double ln(double x) {
+    int k = 0;
+    while (x < 0.5) { x *= 2; k--; }
+    while (x >= 1.0) { x /= 2; k++; }
+
+    double y = (x - 1) / (x + 1);
+    double sum = 0, term = y;
+    for (int n = 1; n < 40; n += 2) {
+      sum += term / n;
+      term *= y * y;
+    }
+    return 2 * sum + k * ln2;
+  }
+
+  constexpr double exp(double x) {
+    int halvings = 0;
+    while (x > 0.5 || x < -0.5) { x /= 2; halvings++; }
+
+    double sum = 1, term = 1;
+    for (int n = 1; n < 20; n++) {
+      term *= x / n;
+      sum += term;
+    }
+    while (halvings--) sum *= sum;
+    return sum;
+  }
+
+  constexpr double pow(double x, double y) {
+    return x <= 0 ? 0 : exp(y * ln(x));
+  }
+}
+
+struct duty_table_t {
+  uint16_t duty[DUTY_LUT_SIZE];
+};
+
+/**
+ * PWM duty for each light level. Brightness is interpolated between the
+ * two on fractions in gamma space, so equal steps in ambient light look
+ * like equal steps in display brightness. OE is active low, so the stored
+ * duty is inverted.
+ */
+constexpr duty_table_t make_duty_table(double min_on, double max_on, double gamma) {
+  duty_table_t table{};
+  double lo = cx::pow(min_on, 1 / gamma);
+  double hi = cx::pow(max_on, 1 / gamma);
+
+  for (int i = 0; i < DUTY_LUT_SIZE; i++) {
+    double on = cx::pow(lo + (hi - lo) * i / (DUTY_LUT_SIZE - 1), gamma);
+    table.duty[i] = (uint16_t) ((1.0 - on) * PWM_RANGE + 0.5);
+  }
+  return table;
+}
+
+static constexpr duty_table_t duty_table = make_duty_table(0.0001, 0.4, 2.2);
+
+/**
+ * Samples the light sensor from a ticker at a fixed rate, filters it with
+ * an integer EMA and reprograms the PWM only when the duty changes.
+ */
+class brightness_control {
+  // EMA of the 10 bit light level, with 6 fractional bits
+  static const int frac_bits = 6;
+  // alpha of 1/8
+  static const int ema_shift = 3;
+
+  uint32_t level = 0;
+  bool has_level = false;
+  int duty = -1;
+  Ticker sample_ticker;
+
+  void sample() {
+    uint32_t raw = (uint32_t) analogRead(A0) << frac_bits;
+    if (this->has_level) {
+      this->level = this->level - (this->level >> ema_shift) + (raw >> ema_shift);
+    } else {
+      this->level = raw;
+      this->has_level = true;
+    }
+
+    int index = (this->level >> frac_bits) * DUTY_LUT_SIZE / 1024;
+    set_duty(duty_table.duty[index < DUTY_LUT_SIZE ? index : DUTY_LUT_SIZE - 1]);
+  }
+
+  static void sample_cb(brightness_control* control) {
+    control->sample();
+  }
+
+public:
+  void begin() {
+    sample_ticker.attach_ms(LIGHT_SAMPLE_MS, &brightness_control::sample_cb, this);
+  }
+
+  void set_duty(int duty) {
+    if (duty == this->duty) {
+      return;
+    }
+    analogWrite(OUTPUT_ENABLE, duty);
+    this->duty = duty;
+  }
+};
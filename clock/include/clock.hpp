@@ -1,5 +1,7 @@
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
+#include <SPI.h>
+#include <Ticker.h>
 #include <time.h>
 #include "defines.hpp"
 
@@ -31,43 +33,54 @@ digit_t number_to_byte[] = {
 class clock_display {
   tm timeinfo;
   digit_t digits[NDIGITS];
+  // last frame latched into the output registers
+  digit_t shown[NDIGITS];
+  bool has_shown = false;
   bool colons = false;
-  bool in_second = false;
-  uint wait_ms = 500;
-  uint last_update = 0;
 
+  // wall time second anchor_sec started at millis() == anchor_ms
+  time_t anchor_sec = 0;
+  uint32_t anchor_ms = 0;
+  bool synced = false;
+  time_t shown_sec = 0;
+  Ticker second_ticker;
+  Ticker colon_ticker;
+
+  /**
+   * Latch the frame if it differs from what's on the display. Over HSPI
+   * (DISPLAY_HSPI) the six bytes fit in the SPI FIFO, so this takes
+   * microseconds.
+   */
   void write_all() {
-    reset();
+    digit_t frame[NDIGITS];
+    for (int i = 0; i < NDIGITS; i++) {
+      // TODO: place colons properly
+      frame[i] = this->digits[i] | (this->colons ? SDP : 0);
+    }
+
+    if (this->has_shown && !memcmp(frame, this->shown, sizeof(frame))) {
+      return;
+    }
 
     // output register latch low
     digitalWrite(RCLK, LOW);
 
+#ifdef DISPLAY_HSPI
+    SPI.writeBytes(frame, sizeof(frame));
+#else
     for (int i = 0; i < NDIGITS; i++) {
-      // shift out the data
-      // TODO: place colons properly
-      uint8_t out = this->digits[i] | (this->colons ? SDP : 0);
-      shiftOut(DATA_PIN, SRCLK, MSBFIRST, out);
+      shiftOut(DATA_PIN, SRCLK, MSBFIRST, frame[i]);
     }
+#endif
 
     // latch high into the output registers
     digitalWrite(RCLK, HIGH);
-  }
 
-  void display_with_flash(uint delay_ms = 1000) {
-    this->colons = true;
-    write_all();
-    delay(delay_ms / 2);
-    this->colons = false;
-    write_all();
-    delay(delay_ms - delay_ms / 2);
+    memcpy(this->shown, frame, sizeof(frame));
+    this->has_shown = true;
   }
 
-  uint display_second() {
-    timeval tv;
-    gettimeofday(&tv, nullptr);
-    uint ms_sleep = 1000 - (tv.tv_usec / 1000);
-    ms_sleep = ms_sleep > 1000 || ms_sleep < 0 ? 1000 : ms_sleep;
-
+  void show_time() {
     this->digits[0] = number_to_byte[timeinfo.tm_sec % 10];
     this->digits[1] = number_to_byte[timeinfo.tm_sec / 10];
     this->digits[2] = number_to_byte[timeinfo.tm_min % 10];
@@ -77,7 +90,43 @@ class clock_display {
 
     this->colons = true;
     write_all();
-    return ms_sleep;
+  }
+
+  /**
+   * Runs from the ticker on each second boundary. Broken down time is only
+   * recomputed when the minute rolls over (or the clock jumped), so DST
+   * changes still land on time.
+   */
+  void on_second() {
+    uint32_t elapsed = millis() - this->anchor_ms;
+    time_t now = this->anchor_sec + (elapsed + 500) / 1000;
+
+    if (now == this->shown_sec + 1 && timeinfo.tm_sec < 59) {
+      timeinfo.tm_sec++;
+    } else {
+      localtime_r(&now, &timeinfo);
+    }
+    this->shown_sec = now;
+
+    show_time();
+    colon_ticker.once_ms(500, &clock_display::colons_off_cb, this);
+    schedule_second();
+  }
+
+  // arm the ticker for the next second boundary, rounding so a tick that
+  // fired a little early doesn't aim at the boundary it was meant for
+  void schedule_second() {
+    uint32_t elapsed = millis() - this->anchor_ms;
+    uint32_t next = ((elapsed + 500) / 1000 + 1) * 1000;
+    second_ticker.once_ms(next - elapsed, &clock_display::on_second_cb, this);
+  }
+
+  static void on_second_cb(clock_display* disp) {
+    disp->on_second();
+  }
+
+  static void colons_off_cb(clock_display* disp) {
+    disp->colons_off();
   }
 
   void colons_off() {
@@ -88,12 +137,37 @@ class clock_display {
 
 public:
 
+  void begin() {
+    pinMode(RCLK, OUTPUT);
+    pinMode(SRCLR, OUTPUT);
+#ifdef DISPLAY_HSPI
+    SPI.begin();
+    SPI.setFrequency(DISPLAY_SPI_HZ);
+    SPI.setDataMode(SPI_MODE0);
+    SPI.setBitOrder(MSBFIRST);
+    // SPI.begin() hands D6 to HSPI as MISO, take it back for the latch
+    pinMode(RCLK, OUTPUT);
+#else
+    pinMode(DATA_PIN, OUTPUT);
+    pinMode(SRCLK, OUTPUT);
+#endif
+    reset();
+  }
+
+  /**
+   * Clear the shift registers, only needed at power up.
+   */
   void reset() {
     digitalWrite(SRCLR, LOW);
-    delay(10);
+    delayMicroseconds(1);
     digitalWrite(SRCLR, HIGH);
+    this->has_shown = false;
   }
 
+  /**
+   * Show v on every pair of digits with the colons blinking once a second.
+   * Doesn't block, call it from loop() for as long as the status holds.
+   */
   void flash(digit_t v) {
     digit_t low = v % 10;
     digit_t high = v / 10;
@@ -102,41 +176,32 @@ public:
       this->digits[i] = number_to_byte[i%2==0 ? low : high];
     }
 
-    display_with_flash();
+    this->colons = millis() % 1000 < 500;
+    write_all();
   }
 
   /**
-   * Display the time, self-throttiling update frequency
+   * Anchor the wall time to millis(), call whenever the clock is set (e.g.
+   * from settimeofday_cb after each NTP sync).
    */
-  void do_second() {
-    static char buf[64];
-
-    // make throttle updates
-    uint now = millis();
-    if ((now - this->last_update) < this->wait_ms) {
-        return;
-    }
-
-    this->last_update = millis();
-
-    if (in_second) {
-        // toggle colons, draw, and wait again
-        this->colons_off();
-        this->in_second = false;
-        return;
-    }
+  void sync() {
+    timeval tv;
+    gettimeofday(&tv, nullptr);
+    this->anchor_ms = millis() - tv.tv_usec / 1000;
+    this->anchor_sec = tv.tv_sec;
+    this->synced = true;
+  }
 
-    // update time, write second
-    if (!getLocalTime(&timeinfo)) {
-        Serial.println("Failed to get time");
-        this->wait_ms = 500;
-        return;
+  /**
+   * Start ticking the time onto the display, once synced. Runs on its own
+   * from then on.
+   */
+  void start() {
+    if (!this->synced) {
+      sync();
     }
 
-    strftime(buf, sizeof(buf), "%A, %B %d %Y %H:%M:%S", &timeinfo);
-    Serial.println(buf);
-    // do first half of second, setting wait to half the second
-    this->wait_ms = display_second() / 2;
-    this->in_second = true;
+    uint32_t elapsed = millis() - this->anchor_ms;
+    second_ticker.once_ms(1000 - elapsed % 1000, &clock_display::on_second_cb, this);
   }
 };
@@ -1,5 +1,14 @@
+// The 74HC595 chain is shifted out by hand on D8/D5. Boards rewired with
+// the data line on D7 can define DISPLAY_HSPI to drive it from HSPI, whose
+// MOSI and SCLK are fixed to D7 and D5.
+#ifdef DISPLAY_HSPI
+#define DATA_PIN D7
+#define OUTPUT_ENABLE D8
+#else
 #define DATA_PIN D8
 #define OUTPUT_ENABLE D7
+#endif
 #define RCLK D6
 #define SRCLK D5
 #define SRCLR D0
+#define DISPLAY_SPI_HZ 8000000
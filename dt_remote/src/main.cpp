@@ -1,13 +1,26 @@
 #include <Arduino.h>
 
-#define ETH_DISABLE_HEADERS
-#define ETH_DISABLE_BODY
-#define ETH_PARSE_BUFFER_SIZE 128
-#define ETH_MAX_ROUTES 2
-#define ETH_MAX_ROUTE_TARGET 8
+#define LOG_RING_SIZE 128
+#define LOG_MAX_LINE 40
 
 #include "utils/eth_server.h"
 
+struct dt_config : EthHTTPServer::default_config {
+    static constexpr int max_connections = 2;
+    static constexpr int parse_buffer_size = 128;
+    static constexpr int max_headers = 0;
+    static constexpr int max_request_body = 0;
+    static constexpr int max_response_len = 0;
+    static constexpr int max_response_headers = 0;
+    static constexpr int max_routes = 0;
+    static constexpr int max_route_target = 8;
+    static constexpr int max_path_params = 0;
+    static constexpr bool not_found_handler = false;
+    static constexpr int write_block_size = 64;
+};
+
+using server_t = EthHTTPServer::Server<dt_config>;
+static server_t server;
 
 #define DT_PIN_PWR 8
 #define DT_PIN_RST 7 
@@ -21,28 +34,33 @@ void toggle_pin(int pin) {
     digitalWrite(pin, LOW);
 }
 
-EthHTTPServer::http_response handle_reset(const EthHTTPServer::http_request&) {
+server_t::response handle_reset(const EthHTTPServer::http_request&) {
     toggle_pin(DT_PIN_RST);
-    return EthHTTPServer::http_response{};
+    return server_t::response{};
 }
 
-EthHTTPServer::http_response handle_power(const EthHTTPServer::http_request&) {
+server_t::response handle_power(const EthHTTPServer::http_request&) {
     toggle_pin(DT_PIN_PWR);
-    return EthHTTPServer::http_response{};
+    return server_t::response{};
 }
 
+static const server_t::static_route routes[] PROGMEM = {
+    ETH_ROUTE(HTTP_ANY, "/reset", &handle_reset),
+    ETH_ROUTE(HTTP_ANY, "/power", &handle_power),
+};
+
 void setup_server() {
     EthHTTPServer::EthServerConfig config;
     memcpy(config.mac, mac, sizeof(mac));
 
     EthHTTPServer::setup(config);
-    EthHTTPServer::add_endpoint("/reset", &handle_reset);
-    EthHTTPServer::add_endpoint("/power", &handle_power);
+    server.begin();
+    server.set_routes(routes);
 }
 
 void setup() {
     Serial.begin(9600);
-    Serial.println("Starting DT Remote Server...");
+    LOG("Starting DT Remote Server...");
     pinMode(LED_BUILTIN, OUTPUT);
     pinMode(DT_PIN_RST, OUTPUT);
     pinMode(DT_PIN_PWR, OUTPUT);
@@ -51,5 +69,6 @@ void setup() {
 }
 
 void loop() {
-    EthHTTPServer::run();
+    server.run();
+    Log::drain();
 }
\ No newline at end of file
@@ -1,22 +1,64 @@
 #include <Arduino.h>
-#include <DHT.h>
-#include <DHT_U.h>
 #include <ESP8266WiFi.h>
 #include <ESP8266WebServer.h>
+#include <coredecls.h>
 
 #include "private.h"
 
 #define PROM_NAMESPACE "drybox"
 #define SENSE_EVERY 10000
 #define HTTP_METRICS_ENDPOINT "/metrics"
+#define HTTP_HISTORY_ENDPOINT "/metrics/history"
+#define HTTP_BINARY_ENDPOINT "/metrics.bin"
+#define HTTP_SCHEMA_ENDPOINT "/metrics/schema"
 #define HTTP_BLINK_ENDPOINT "/blink"
 #define HTTP_SERVER_PORT 80
+#define RESPONSE_CACHE_SIZE 3072
 
 #define DHT1_PIN D7
 #define DHT2_PIN D6
 
-DHT dht_ext(DHT1_PIN, DHT22);
-DHT dht_int(DHT2_PIN, DHT22);
+#include "utils/prom_metrics.h"
+#include "utils/sampler.h"
+#include "utils/dht_async.h"
+#include "utils/metric_history.h"
+#include "utils/response_cache.h"
+#include "utils/wifi_fast.h"
+#include "utils/log_ring.h"
+#include "utils/loop_profiler.h"
+
+/*
+ * Define PUSH_MODE to deep sleep between samples and POST them to PUSH_URL
+ * in batches instead of serving them.
+ */
+#ifdef PUSH_MODE
+#include <ESP8266HTTPClient.h>
+#include <StreamString.h>
+
+#ifndef PUSH_URL
+#error "Define PUSH_URL (e.g. in private.h) for push mode"
+#endif
+
+// samples per upload
+#ifndef PUSH_BATCH
+#define PUSH_BATCH 12
+#endif
+
+// set to 0 for a Pushgateway, which won't take timestamps, to push only the latest sample
+#ifndef PUSH_TIMESTAMPS
+#define PUSH_TIMESTAMPS 1
+#endif
+
+#define PUSH_CONNECT_TIMEOUT 10000
+#define PUSH_NTP_TIMEOUT 5000
+// after n failed pushes in a row the radio stays off for 2^n wakes, up to 2^PUSH_MAX_BACKOFF
+#define PUSH_MAX_BACKOFF 6
+// in 4 byte blocks, after WifiFast's association
+#define PUSH_RTC_OFFSET 8
+#endif
+
+DhtAsync::sensor_t dht_ext;
+DhtAsync::sensor_t dht_int;
 ESP8266WebServer http_server(HTTP_SERVER_PORT);
 
 struct dht_reading_t {
@@ -29,32 +71,270 @@ struct dht_reading_t {
 struct full_reading_t {
     dht_reading_t interior;
     dht_reading_t exterior;
-    uint64_t millis = 0;
-    bool success = false;
 };
 
-dht_reading_t sense(DHT& dht) {
-  float h = dht.readHumidity();
-  float t = dht.readTemperature();
-  return dht_reading_t{
-    t,
-    h,
-    dht.computeHeatIndex(t, h, false),
-    !(isnan(t) || isnan(h)),
-  };
+static full_reading_t reading{{NAN, NAN, NAN, false}, {NAN, NAN, NAN, false}};
+static Prom::registry_t metrics;
+static Sampler::scheduler_t sampler;
+static History::history_t history;
+static ResponseCache::cache_t metrics_cache;
+
+/*
+ * Streams a chunked response through http_server, a block at a time.
+ */
+class chunked_response : public Print {
+  char block[256];
+  size_t used = 0;
+
+  void send_block() {
+    if (used) {
+      http_server.sendContent(block, used);
+      used = 0;
+    }
+  }
+
+public:
+  chunked_response(int code, const char* content_type) {
+    http_server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    http_server.send(code, content_type, "");
+  }
+
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t* data, size_t len) override {
+    size_t written = 0;
+    while (written < len) {
+      if (used == sizeof(block))
+        send_block();
+
+      size_t n = min(len - written, sizeof(block) - used);
+      memcpy(block + used, data + written, n);
+      used += n;
+      written += n;
+    }
+    return written;
+  }
+
+  void end() {
+    send_block();
+    // empty chunk terminates the response
+    http_server.sendContent("");
+  }
+};
+
+Sampler::sample_status sense(DhtAsync::sensor_t& dht, dht_reading_t& out) {
+  switch (DhtAsync::read(dht)) {
+  case DhtAsync::read_pending:
+    return Sampler::sample_pending;
+  case DhtAsync::read_ok:
+    out = dht_reading_t{
+      dht.temp,
+      dht.humidity,
+      DhtAsync::heat_index(dht.temp, dht.humidity),
+      true,
+    };
+    return Sampler::sample_ok;
+  default:
+    return Sampler::sample_failed;
+  }
+}
+
+Sampler::sample_status sample_interior(dht_reading_t& out) {
+  return sense(dht_int, out);
 }
 
-full_reading_t sense_all() {
-  auto interior = sense(dht_int);
-  auto exterior = sense(dht_ext);
-  return full_reading_t{
-    interior,
-    exterior,
-    millis(),
-    interior.success && exterior.success,
-  };
+Sampler::sample_status sample_exterior(dht_reading_t& out) {
+  return sense(dht_ext, out);
 }
 
+#ifdef PUSH_MODE
+/*
+ * Samples kept in RTC memory across deep sleep until they're pushed. Times
+ * are on a clock that only counts time awake and asleep, the epoch offset
+ * is learned over NTP whenever the radio is up.
+ */
+struct push_sample_t {
+  uint32_t clock;   // seconds
+  // hundredths, exterior then interior
+  int16_t temp[2];
+  int16_t humidity[2];
+};
+
+struct push_state_t {
+  uint32_t crc;
+  uint32_t count;
+  uint64_t clock_ms;
+  uint32_t epoch_offset;  // 0 until the first NTP sync
+  uint32_t failures;  // in a row
+  uint32_t backoff;   // full batch wakes left before the next attempt
+  push_sample_t samples[PUSH_BATCH];
+};
+
+static_assert(sizeof(push_state_t) <= 512 - PUSH_RTC_OFFSET * 4, "PUSH_BATCH doesn't fit in RTC memory");
+
+static push_state_t push_state;
+static int push_first;
+
+const int16_t push_nan = INT16_MIN;
+
+uint32_t push_checksum() {
+  return WifiFast::crc32((const uint8_t*) &push_state + sizeof(push_state.crc), sizeof(push_state) - sizeof(push_state.crc));
+}
+
+void load_push_state() {
+  bool ok = ESP.rtcUserMemoryRead(PUSH_RTC_OFFSET, (uint32_t*) &push_state, sizeof(push_state));
+  if (!ok || push_state.crc != push_checksum() || push_state.count > PUSH_BATCH) {
+    memset(&push_state, 0, sizeof(push_state));
+  }
+}
+
+void save_push_state() {
+  push_state.crc = push_checksum();
+  ESP.rtcUserMemoryWrite(PUSH_RTC_OFFSET, (uint32_t*) &push_state, sizeof(push_state));
+}
+
+int16_t pack(float v) {
+  return isnan(v) ? push_nan : (int16_t) lroundf(v * 100);
+}
+
+float unpack(int16_t v) {
+  return v == push_nan ? NAN : v / 100.0f;
+}
+
+void unpack_reading(int16_t temp, int16_t humidity, dht_reading_t& out) {
+  out.temp = unpack(temp);
+  out.humidity = unpack(humidity);
+  out.heat_index = DhtAsync::heat_index(out.temp, out.humidity);
+}
+
+/*
+ * Points the registry's values at buffered sample push_first + i.
+ */
+uint32_t load_push_sample(int i) {
+  const push_sample_t& sample = push_state.samples[push_first + i];
+  unpack_reading(sample.temp[0], sample.humidity[0], reading.exterior);
+  unpack_reading(sample.temp[1], sample.humidity[1], reading.interior);
+
+  if (!PUSH_TIMESTAMPS || !push_state.epoch_offset) {
+    return 0;
+  }
+  return sample.clock + push_state.epoch_offset;
+}
+
+void take_push_sample() {
+  dht_reading_t exterior{NAN, NAN, NAN, false};
+  dht_reading_t interior{NAN, NAN, NAN, false};
+  Sampler::sample_status ext_status = Sampler::sample_pending;
+  Sampler::sample_status int_status = Sampler::sample_pending;
+
+  while (ext_status == Sampler::sample_pending || int_status == Sampler::sample_pending) {
+    if (ext_status == Sampler::sample_pending)
+      ext_status = sense(dht_ext, exterior);
+    if (int_status == Sampler::sample_pending)
+      int_status = sense(dht_int, interior);
+    yield();
+  }
+
+  // a full buffer means the last pushes failed, drop the oldest
+  if (push_state.count == PUSH_BATCH) {
+    memmove(push_state.samples, push_state.samples + 1, sizeof(push_sample_t) * (PUSH_BATCH - 1));
+    push_state.count--;
+  }
+
+  push_sample_t& sample = push_state.samples[push_state.count++];
+  sample.clock = (push_state.clock_ms + millis()) / 1000;
+  sample.temp[0] = pack(exterior.temp);
+  sample.humidity[0] = pack(exterior.humidity);
+  sample.temp[1] = pack(interior.temp);
+  sample.humidity[1] = pack(interior.humidity);
+}
+
+bool connect_for_push() {
+  WifiFast::begin(WIFI_SSID, WIFI_PASS);
+  configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+
+  unsigned long started = millis();
+  while (!WifiFast::is_connected()) {
+    if (millis() - started > PUSH_CONNECT_TIMEOUT)
+      return false;
+    WifiFast::run();
+    delay(10);
+  }
+
+  // anything after 2020 means SNTP has set the clock
+  started = millis();
+  while (time(nullptr) < 1577836800 && millis() - started < PUSH_NTP_TIMEOUT) {
+    delay(10);
+  }
+  if (time(nullptr) >= 1577836800) {
+    push_state.epoch_offset = time(nullptr) - (push_state.clock_ms + millis()) / 1000;
+  }
+  return true;
+}
+
+bool push_batch() {
+  // without timestamps only the latest sample means anything
+  bool timestamps = PUSH_TIMESTAMPS && push_state.epoch_offset;
+  push_first = timestamps ? 0 : push_state.count - 1;
+
+  StreamString body;
+  Prom::render_batch(metrics, body, push_state.count - push_first, &load_push_sample);
+
+  WiFiClient client;
+  HTTPClient http;
+  if (!http.begin(client, PUSH_URL))
+    return false;
+
+  http.addHeader("Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+  int code = http.POST(body);
+  http.end();
+
+  LOG("Pushed %d samples: %d", push_state.count - push_first, code);
+  return code >= 200 && code < 300;
+}
+
+/*
+ * One wake: sample, push when the batch is full and sleep until the next
+ * sample is due. The radio is only powered on the wakes that push, and
+ * failed pushes back off exponentially so a dead AP or collector doesn't
+ * cost a connect attempt every wake.
+ */
+void push_cycle() {
+  load_push_state();
+
+  bool woke = ESP.getResetInfoPtr()->reason == REASON_DEEP_SLEEP_AWAKE;
+  DhtAsync::begin(dht_ext, DHT1_PIN, woke);
+  DhtAsync::begin(dht_int, DHT2_PIN, woke);
+  take_push_sample();
+
+  if (push_state.count == PUSH_BATCH) {
+    if (push_state.backoff) {
+      push_state.backoff--;
+    } else if (connect_for_push() && push_batch()) {
+      push_state.count = 0;
+      push_state.failures = 0;
+    } else {
+      push_state.failures++;
+      push_state.backoff = 1UL << min(push_state.failures, (uint32_t) PUSH_MAX_BACKOFF);
+    }
+  }
+
+  unsigned long awake = millis();
+  // a zero deep sleep never wakes
+  unsigned long sleep_ms = awake + 100 < SENSE_EVERY ? SENSE_EVERY - awake : 100;
+  push_state.clock_ms += awake + sleep_ms;
+  save_push_state();
+  Log::flush();
+
+  // only power the radio for a wake that will push
+  bool push_next = push_state.count + 1 >= PUSH_BATCH && !push_state.backoff;
+  RFMode rf = push_next ? RF_DEFAULT : RF_DISABLED;
+  ESP.deepSleep(sleep_ms * 1000, rf);
+}
+#endif
+
 void esp8266_main_led(bool val) {
   // high and low are backwards?
   digitalWrite(LED_BUILTIN, val ? LOW : HIGH);
@@ -62,17 +342,16 @@ void esp8266_main_led(bool val) {
 
 // endpoints
 
+static const char root_body[] PROGMEM =
+  "Prometheus ESP8266 Sensor Exporter.\n"
+  "\n"
+  "Referenced heavily from: https://github.com/HON95/prometheus-esp8266-dht-exporter\n"
+  "\n"
+  "Usage: " HTTP_METRICS_ENDPOINT "\n"
+  "Binary: " HTTP_BINARY_ENDPOINT ", layout in " HTTP_SCHEMA_ENDPOINT "\n";
+
 void handle_http_root() {
-  static size_t const BUFSIZE = 256;
-  static char const *response_template =
-    "Prometheus ESP8266 Sensor Exporter.\n"
-    "\n"
-    "Referenced heavily from: https://github.com/HON95/prometheus-esp8266-dht-exporter\n"
-    "\n"
-    "Usage: %s\n";
-  char response[BUFSIZE];
-  snprintf(response, BUFSIZE, response_template, HTTP_METRICS_ENDPOINT);
-  http_server.send(200, "text/plain; charset=utf-8", response);
+  http_server.send_P(200, PSTR("text/plain; charset=utf-8"), root_body, sizeof(root_body) - 1);
 }
 
 void handle_http_not_found() {
@@ -87,97 +366,152 @@ void http_blink() {
 }
 
 void handle_http_metrics() {
-  static bool has_sensed = false;
-  static full_reading_t reading;
-  static size_t const BUFSIZE = 2048;
-  static char const *response_template =
-      // exterior
-      "# HELP " PROM_NAMESPACE "_exterior_humidity_percent Air humidity.\n"
-      "# TYPE " PROM_NAMESPACE "_exterior_humidity_percent gauge\n"
-      "# UNIT " PROM_NAMESPACE "_exterior_humidity_percent %%\n"
-      PROM_NAMESPACE "_exterior_humidity_percent %f\n"
-      "# HELP " PROM_NAMESPACE "_exterior_temperature_celsius Air temperature.\n"
-      "# TYPE " PROM_NAMESPACE "_exterior_temperature_celsius gauge\n"
-      "# UNIT " PROM_NAMESPACE "_exterior_temperature_celsius \u00B0C\n"
-      PROM_NAMESPACE "_exterior_temperature_celsius %f\n"
-      "# HELP " PROM_NAMESPACE "_exterior_heat_index_celsius Heat index.\n"
-      "# TYPE " PROM_NAMESPACE "_exterior_heat_index_celsius gauge\n"
-      "# UNIT " PROM_NAMESPACE "_exterior_heat_index_celsius \u00B0C\n"
-      PROM_NAMESPACE "_exterior_heat_index_celsius %f\n"
-      // interior 
-      "# HELP " PROM_NAMESPACE "_interior_humidity_percent Air humidity.\n"
-      "# TYPE " PROM_NAMESPACE "_interior_humidity_percent gauge\n"
-      "# UNIT " PROM_NAMESPACE "_interior_humidity_percent %%\n"
-      PROM_NAMESPACE "_interior_humidity_percent %f\n"
-      "# HELP " PROM_NAMESPACE "_interior_temperature_celsius Air temperature.\n"
-      "# TYPE " PROM_NAMESPACE "_interior_temperature_celsius gauge\n"
-      "# UNIT " PROM_NAMESPACE "_interior_temperature_celsius \u00B0C\n"
-      PROM_NAMESPACE "_interior_temperature_celsius %f\n"
-      "# HELP " PROM_NAMESPACE "_interior_heat_index_celsius Heat index.\n"
-      "# TYPE " PROM_NAMESPACE "_interior_heat_index_celsius gauge\n"
-      "# UNIT " PROM_NAMESPACE "_interior_heat_index_celsius \u00B0C\n"
-      PROM_NAMESPACE "_interior_heat_index_celsius %f\n";
+  static const char* content_type = "text/plain; charset=utf-8";
+  char etag[24];
+  uint32_t generation = Sampler::publish(sampler, SENSE_EVERY);
 
   esp8266_main_led(true);
-  if (!has_sensed || millis() - reading.millis > SENSE_EVERY) {
-    reading = sense_all();
-    if (!reading.success) {
-        http_server.send(500, "text/plain; charset=utf-8", "Sensor error.");
-        return;
+  if (ResponseCache::is_fresh(metrics_cache, generation)) {
+    ResponseCache::format_etag(metrics_cache, etag);
+    const String& if_none_match = http_server.header("If-None-Match");
+    http_server.sendHeader("ETag", etag);
+
+    if (ResponseCache::etag_matches(if_none_match.c_str(), if_none_match.length(), etag)) {
+      http_server.send(304);
+      esp8266_main_led(false);
+      return;
     }
 
-    has_sensed = true;
+    if (metrics_cache.complete) {
+      http_server.send(200, content_type, metrics_cache.body, metrics_cache.len);
+      esp8266_main_led(false);
+      return;
+    }
   }
 
-  char response[BUFSIZE];
-  snprintf(
-    response,
-    BUFSIZE,
-    response_template,
-    reading.exterior.humidity,
-    reading.exterior.temp,
-    reading.exterior.heat_index,
-    reading.interior.humidity,
-    reading.interior.temp,
-    reading.interior.heat_index
-  );
+  Sampler::update_ages(sampler);
+  ResponseCache::begin_render(metrics_cache, generation);
+  ResponseCache::format_etag(metrics_cache, etag);
+  http_server.sendHeader("ETag", etag);
 
-  http_server.send(200, "text/plain; charset=utf-8", response);
+  chunked_response out(200, content_type);
+  ResponseCache::tee_writer tee(out, metrics_cache);
+  Prom::render(metrics, tee);
+  out.end();
 
-  Serial.println("Sent metrics");
+  LOG("Sent metrics");
   esp8266_main_led(false);
 }
 
+void handle_http_history() {
+  const String& since_arg = http_server.arg("since");
+  char* end;
+  uint32_t since = strtoul(since_arg.c_str(), &end, 10);
+  if (*end) {
+    http_server.send(400, "text/plain; charset=utf-8", "since must be a timestamp in seconds");
+    return;
+  }
+
+  // a page at a time, the rest is linked
+  uint32_t until = History::page_end(history, since);
+  if (until) {
+    char link[40];
+    snprintf(link, sizeof(link), "<?since=%lu>; rel=\"next\"", (unsigned long) until);
+    http_server.sendHeader("Link", link);
+  }
+
+  chunked_response out(200, "application/openmetrics-text; version=1.0.0; charset=utf-8");
+  History::render(history, since, out, until);
+  out.end();
+}
+
+void handle_http_binary() {
+  uint8_t body[Prom::max_binary_size];
+  Sampler::update_ages(sampler);
+  int len = Prom::encode_binary(metrics, History::now_seconds(history) + history.epoch_offset, body);
+  http_server.send(200, "application/octet-stream", (const char*) body, len);
+}
+
+void handle_http_schema() {
+  chunked_response out(200, "text/plain; charset=utf-8");
+  Prom::render_schema(metrics, out);
+  out.end();
+}
+
+void handle_http_log() {
+  chunked_response out(200, "text/plain; charset=utf-8");
+  Log::render_tail(out);
+  out.end();
+}
+
+void handle_http_loop() {
+  chunked_response out(200, "text/plain; version=0.0.4; charset=utf-8");
+  LoopProfiler::render(out);
+  out.end();
+}
+
+void setup_metrics() {
+  PROM_GAUGE(metrics, "exterior_humidity_percent", "Air humidity.", "%", &reading.exterior.humidity);
+  PROM_GAUGE(metrics, "exterior_temperature_celsius", "Air temperature.", "\u00B0C", &reading.exterior.temp);
+  PROM_GAUGE(metrics, "exterior_heat_index_celsius", "Heat index.", "\u00B0C", &reading.exterior.heat_index);
+  PROM_GAUGE(metrics, "interior_humidity_percent", "Air humidity.", "%", &reading.interior.humidity);
+  PROM_GAUGE(metrics, "interior_temperature_celsius", "Air temperature.", "\u00B0C", &reading.interior.temp);
+  PROM_GAUGE(metrics, "interior_heat_index_celsius", "Heat index.", "\u00B0C", &reading.interior.heat_index);
+}
+
+void setup_sampler() {
+  Sampler::task_t* exterior = Sampler::add_task(sampler, &sample_exterior, &reading.exterior, SENSE_EVERY);
+  Sampler::task_t* interior = Sampler::add_task(sampler, &sample_interior, &reading.interior, SENSE_EVERY);
+
+  PROM_LABELED_GAUGE(metrics, "sensor_age_seconds", "sensor=\"exterior\"", "Seconds since the last good sample.", "s", &exterior->age);
+  PROM_SERIES(metrics, "sensor_age_seconds", "sensor=\"interior\"", &interior->age);
+  PROM_LABELED_COUNTER(metrics, "sensor_errors_total", "sensor=\"exterior\"", "Failed sensor reads.", &exterior->errors);
+  PROM_SERIES(metrics, "sensor_errors_total", "sensor=\"interior\"", &interior->errors);
+}
+
+void setup_history() {
+  HISTORY_CHANNEL(history, "exterior_humidity_percent", &reading.exterior.humidity);
+  HISTORY_CHANNEL(history, "exterior_temperature_celsius", &reading.exterior.temp);
+  HISTORY_CHANNEL(history, "exterior_heat_index_celsius", &reading.exterior.heat_index);
+  HISTORY_CHANNEL(history, "interior_humidity_percent", &reading.interior.humidity);
+  HISTORY_CHANNEL(history, "interior_temperature_celsius", &reading.interior.temp);
+  HISTORY_CHANNEL(history, "interior_heat_index_celsius", &reading.interior.heat_index);
+}
+
 void setup_http_server() {
-    Serial.println("Setting up HTTP server");
+    LOG("Setting up HTTP server");
     http_server.on("/", HTTPMethod::HTTP_GET, handle_http_root);
     http_server.on(HTTP_METRICS_ENDPOINT, HTTPMethod::HTTP_GET, handle_http_metrics);
+    http_server.on(HTTP_HISTORY_ENDPOINT, HTTPMethod::HTTP_GET, handle_http_history);
+    http_server.on(HTTP_BINARY_ENDPOINT, HTTPMethod::HTTP_GET, handle_http_binary);
+    http_server.on(HTTP_SCHEMA_ENDPOINT, HTTPMethod::HTTP_GET, handle_http_schema);
+    http_server.on("/debug/log", HTTPMethod::HTTP_GET, handle_http_log);
+    http_server.on("/debug/loop", HTTPMethod::HTTP_GET, handle_http_loop);
     http_server.on(HTTP_BLINK_ENDPOINT, HTTPMethod::HTTP_GET, http_blink);
     http_server.onNotFound(handle_http_not_found);
+    static const char* cache_headers[] = {"If-None-Match"};
+    http_server.collectHeaders(cache_headers, 1);
     http_server.begin();
-    Serial.println("HTTP server started");
+    LOG("HTTP server started");
+}
+
+// runs on every SNTP update
+void on_time_set() {
+  History::set_wall_clock(history, time(nullptr));
 }
 
 void setup_wifi() {
-  // // Begin WiFi
-  WiFi.begin(WIFI_SSID, WIFI_PASS);
-
-  // Connecting to WiFi...
-  Serial.print("Connecting to ");
-  Serial.print(WIFI_SSID);
-  // Loop continuously while WiFi is not connected
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(100);
-    Serial.print(".");
-  }
-
-  // Connected to WiFi
-  Serial.println();
-  Serial.print("Connected! IP address: ");
-  Serial.println(WiFi.localIP());
-  esp8266_main_led(true);
-  delay(500);
-  esp8266_main_led(false);
+  LOG("Connecting to %s", WIFI_SSID);
+  WifiFast::begin(WIFI_SSID, WIFI_PASS);
+  settimeofday_cb(on_time_set);
+  configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+}
+
+void run_wifi() {
+  if (!WifiFast::run())
+    return;
+
+  LOG("Connected! IP address: %s", WiFi.localIP().toString().c_str());
 }
 
 // Main
@@ -186,15 +520,29 @@ void setup() {
     Serial.begin(9600);
     pinMode(LED_BUILTIN, OUTPUT);
 
-    Serial.println("Starting up...");
+    LOG("Starting up...");
+
+#ifdef PUSH_MODE
+    setup_metrics();
+    // sleeps, the next sample starts over from setup()
+    push_cycle();
+#endif
 
-    dht_int.begin();
-    dht_ext.begin();
+    DhtAsync::begin(dht_ext, DHT1_PIN);
+    DhtAsync::begin(dht_int, DHT2_PIN);
+    setup_metrics();
+    setup_sampler();
+    setup_history();
 
     setup_wifi();
     setup_http_server();
 }
 
 void loop() {
-  http_server.handleClient();
+  LoopProfiler::tick();
+  { LOOP_PROFILE("wifi"); run_wifi(); }
+  { LOOP_PROFILE("http"); http_server.handleClient(); }
+  { LOOP_PROFILE("sampler"); Sampler::run(sampler); }
+  { LOOP_PROFILE("history"); History::run(history); }
+  Log::drain();
 }
\ No newline at end of file
@@ -1,97 +1,211 @@
+#define RESPONSE_CACHE_SIZE 8192
+
 #include "sensors.h"
 #include "eth_server.h"
 
 #define PROM_NAMESPACE "garden"
 #define SENSE_EVERY 10000
 #define HTTP_METRICS_ENDPOINT "/metrics"
+#define HISTORY_BLOCKS 64
+
+#include "prom_metrics.h"
+#include "sampler.h"
+#include "metric_history.h"
+#include "loop_profiler.h"
+#include "eth_ntp.h"
+
+static sensor_reading_t reading{{NAN, NAN, false}, {NAN, NAN, false}, NAN, {{NAN, NAN, NAN, NAN}}, 0};
+static Prom::registry_t metrics;
+static Sampler::scheduler_t sampler;
+static History::history_t history;
+static ResponseCache::cache_t metrics_cache;
+static EthNtp::client_t ntp;
 
+struct garden_config : EthHTTPServer::default_config {
+    static constexpr bool instrumentation = true;
+};
+
+static EthHTTPServer::Server<garden_config> server;
 
 void setup() {
     Serial.begin(115200);
     // while (!Serial) delay(10);
     pinMode(LED_BUILTIN, OUTPUT);
     setup_sensors();
+    setup_sampler();
+    setup_history();
     setup_server();
+    EthNtp::begin(ntp);
 }
 
 void loop() {
-    EthHTTPServer::run();
+    LoopProfiler::tick();
+    { LOOP_PROFILE("http"); server.run(); }
+    { LOOP_PROFILE("sampler"); Sampler::run(sampler); }
+    { LOOP_PROFILE("history"); History::run(history); }
+    { LOOP_PROFILE("ntp"); run_ntp(); }
+    Log::drain();
+}
+
+void run_ntp() {
+    uint32_t now;
+    if (EthNtp::run(ntp, now))
+        History::set_wall_clock(history, now);
 }
 
 // Setup / run
 
+Sampler::sample_status sample_dht(DhtAsync::sensor_t& dht, dht_reading_t& out) {
+    switch (poll_dht(dht, out)) {
+    case DhtAsync::read_pending:
+        return Sampler::sample_pending;
+    case DhtAsync::read_ok:
+        return Sampler::sample_ok;
+    default:
+        return Sampler::sample_failed;
+    }
+}
+
+Sampler::sample_status sample_dht1(dht_reading_t& out) {
+    return sample_dht(dht1, out);
+}
+
+Sampler::sample_status sample_dht2(dht_reading_t& out) {
+    return sample_dht(dht2, out);
+}
+
+Sampler::sample_status sample_ph(float& out) {
+    if (!PhAdc::ready())
+        return Sampler::sample_pending;
+
+    out = read_ph(reading.liquid.temp[0], false);
+    return Sampler::sample_ok;
+}
+
+Sampler::sample_status sample_liquid_temp(liquid_reading_t& out) {
+    switch (poll_probes(out)) {
+    case probes_pending:
+        return Sampler::sample_pending;
+    case probes_ok:
+        return Sampler::sample_ok;
+    default:
+        return Sampler::sample_failed;
+    }
+}
+
+void setup_sampler() {
+    // DHT22s can't be read more often than every 2s
+    Sampler::task_t* dht1_task = Sampler::add_task(sampler, &sample_dht1, &reading.dht1, 2000);
+    Sampler::task_t* dht2_task = Sampler::add_task(sampler, &sample_dht2, &reading.dht2, 2000);
+    Sampler::task_t* ph_task = Sampler::add_task(sampler, &sample_ph, &reading.ph, 250);
+    Sampler::task_t* liquid_task = Sampler::add_task(sampler, &sample_liquid_temp, &reading.liquid, SENSE_EVERY);
+
+    setup_metrics();
+    PROM_LABELED_GAUGE(metrics, "sensor_age_seconds", "sensor=\"dht1\"", "Seconds since the last good sample.", "s", &dht1_task->age);
+    PROM_SERIES(metrics, "sensor_age_seconds", "sensor=\"dht2\"", &dht2_task->age);
+    PROM_SERIES(metrics, "sensor_age_seconds", "sensor=\"ph\"", &ph_task->age);
+    PROM_SERIES(metrics, "sensor_age_seconds", "sensor=\"liquid\"", &liquid_task->age);
+    PROM_LABELED_COUNTER(metrics, "sensor_errors_total", "sensor=\"dht1\"", "Failed sensor reads.", &dht1_task->errors);
+    PROM_SERIES(metrics, "sensor_errors_total", "sensor=\"dht2\"", &dht2_task->errors);
+    PROM_SERIES(metrics, "sensor_errors_total", "sensor=\"ph\"", &ph_task->errors);
+    PROM_SERIES(metrics, "sensor_errors_total", "sensor=\"liquid\"", &liquid_task->errors);
+}
+
+void setup_metrics() {
+    PROM_GAUGE(metrics, "air_humidity_percent", "Air humidity.", "%", &reading.dht1.humidity);
+    PROM_GAUGE(metrics, "air_temperature_celsius", "Air temperature.", "\u00B0C", &reading.dht1.temp);
+    PROM_GAUGE(metrics, "bucket_humidity_percent", "Bucket humidity.", "%", &reading.dht2.humidity);
+    PROM_GAUGE(metrics, "bucket_temperature_celsius", "Bucket temperature.", "\u00B0C", &reading.dht2.temp);
+    PROM_GAUGE(metrics, "solution_ph", "Solution ph.", "pH", &reading.ph);
+    PROM_GAUGE(metrics, "solution_temperature_celsius", "Solution temperature.", "\u00B0C", &reading.liquid.temp[0]);
+
+    // any further probes found on the bus
+    if (probes.num_probes > 1)
+        PROM_LABELED_GAUGE(metrics, "reservoir_temperature_celsius", "probe=\"1\"", "Reservoir temperature.", "\u00B0C", &reading.liquid.temp[1]);
+    if (probes.num_probes > 2)
+        PROM_SERIES(metrics, "reservoir_temperature_celsius", "probe=\"2\"", &reading.liquid.temp[2]);
+    if (probes.num_probes > 3)
+        PROM_SERIES(metrics, "reservoir_temperature_celsius", "probe=\"3\"", &reading.liquid.temp[3]);
+}
+
+void setup_history() {
+    HISTORY_CHANNEL(history, "air_humidity_percent", &reading.dht1.humidity);
+    HISTORY_CHANNEL(history, "air_temperature_celsius", &reading.dht1.temp);
+    HISTORY_CHANNEL(history, "bucket_humidity_percent", &reading.dht2.humidity);
+    HISTORY_CHANNEL(history, "bucket_temperature_celsius", &reading.dht2.temp);
+    HISTORY_CHANNEL(history, "solution_ph", &reading.ph);
+    HISTORY_CHANNEL(history, "solution_temperature_celsius", &reading.liquid.temp[0]);
+}
+
+ETH_STATIC_RESPONSE(root_response, "200 Success", "text/plain; charset=utf-8",
+    "Prometheus Sensor Exporter.\n"
+    "\n"
+    "Referenced heavily from: https://github.com/HON95/prometheus-esp8266-dht-exporter\n"
+    "\n"
+    "Usage: " HTTP_METRICS_ENDPOINT "\n");
+
 void setup_server() {
-    EthHTTPServer::setup();
-    EthHTTPServer::add_endpoint("/", &handle_http_root);
-    EthHTTPServer::add_endpoint("/metrics", &handle_http_metrics);
-}
-
-EthHTTPServer::http_response handle_http_root(const EthHTTPServer::http_request&) {
-    static const char* response_template =
-        "Prometheus Sensor Exporter.\n"
-        "\n"
-        "Referenced heavily from: https://github.com/HON95/prometheus-esp8266-dht-exporter\n"
-        "\n"
-        "Usage: %s\n";
-    EthHTTPServer::http_response response;
-    snprintf(response.body, 256, response_template, HTTP_METRICS_ENDPOINT);
-    return response;
-}
-
-EthHTTPServer::http_response handle_http_metrics(const EthHTTPServer::http_request&) {
-    static bool has_sensed = false;
-    static sensor_reading_t reading;
-    static const char* response_template =
-            "# HELP " PROM_NAMESPACE "_air_humidity_percent Air humidity.\n"
-            "# TYPE " PROM_NAMESPACE "_air_humidity_percent gauge\n"
-            "# UNIT " PROM_NAMESPACE "_air_humidity_percent %%\n"
-            PROM_NAMESPACE "_air_humidity_percent %f\n"
-            "# HELP " PROM_NAMESPACE "_air_temperature_celsius Air temperature.\n"
-            "# TYPE " PROM_NAMESPACE "_air_temperature_celsius gauge\n"
-            "# UNIT " PROM_NAMESPACE "_air_temperature_celsius \u00B0C\n"
-            PROM_NAMESPACE "_air_temperature_celsius %f\n"
-            "# HELP " PROM_NAMESPACE "_bucket_humidity_percent Bucket humidity.\n"
-            "# TYPE " PROM_NAMESPACE "_bucket_humidity_percent gauge\n"
-            "# UNIT " PROM_NAMESPACE "_bucket_humidity_percent %%\n"
-            PROM_NAMESPACE "_bucket_humidity_percent %f\n"
-            "# HELP " PROM_NAMESPACE "_bucket_temperature_celsius Bucket temperature.\n"
-            "# TYPE " PROM_NAMESPACE "_bucket_temperature_celsius gauge\n"
-            "# UNIT " PROM_NAMESPACE "_bucket_temperature_celsius \u00B0C\n"
-            PROM_NAMESPACE "_bucket_temperature_celsius %f\n"
-            "# HELP " PROM_NAMESPACE "_solution_ph Solution ph.\n"
-            "# TYPE " PROM_NAMESPACE "_solution_ph gauge\n"
-            "# UNIT " PROM_NAMESPACE "_solution_ph pH\n"
-            PROM_NAMESPACE "_solution_ph %f\n"
-            "# HELP " PROM_NAMESPACE "_solution_temperature_celsius Solution temperature.\n"
-            "# TYPE " PROM_NAMESPACE "_solution_temperature_celsius gauge\n"
-            "# UNIT " PROM_NAMESPACE "_solution_temperature_celsius \u00B0C\n"
-            PROM_NAMESPACE "_solution_temperature_celsius %f\n";
-
-    EthHTTPServer::http_response response;
-
-    if (!has_sensed || millis() - reading.millis > 5000) {
-        reading = read_sensors();
-        if (!reading.dht1.success || !reading.dht2.success) {
-            response.code = 500;
-            strcpy(response.code_msg, "Server Error");
-            strcpy(response.body, "Sensing error!");
-            return response;
-        }
-
-        has_sensed = true;
+    EthHTTPServer::setup(EthHTTPServer::EthServerConfig{});
+    server.begin();
+    server.add_endpoint("/", &root_response);
+    server.add_endpoint("/metrics", &handle_http_metrics);
+    server.add_endpoint("/metrics/history", &handle_http_history);
+    server.add_endpoint("/metrics.bin", &handle_http_binary);
+    server.add_endpoint("/metrics/schema", &handle_http_schema);
+    server.add_endpoint("/debug/log", &handle_http_log);
+    server.add_endpoint("/debug/loop", &handle_http_loop);
+}
+
+void render_metrics(Print& out) {
+    Sampler::update_ages(sampler);
+    Prom::render(metrics, out);
+}
+
+void handle_http_metrics(const EthHTTPServer::http_request& req, EthHTTPServer::response_writer& out) {
+    EthHTTPServer::send_cached(req, out, metrics_cache, Sampler::publish(sampler, SENSE_EVERY), &render_metrics);
+    LOG("Sent metrics");
+}
+
+void handle_http_history(const EthHTTPServer::http_request& req, EthHTTPServer::response_writer& out) {
+    uint32_t since = 0;
+    EthHTTPServer::str_view since_param = EthHTTPServer::find_query_param(req, "since");
+    if (since_param.len && !since_param.to_uint(since)) {
+        out.begin(400, "Bad Request");
+        out.print("since must be a timestamp in seconds");
+        return;
+    }
+
+    // a page at a time, the rest is linked
+    uint32_t until = History::page_end(history, since);
+    out.begin(200, "Success", "application/openmetrics-text; version=1.0.0; charset=utf-8");
+    if (until) {
+        char link[40];
+        snprintf(link, sizeof(link), "<?since=%lu>; rel=\"next\"", (unsigned long) until);
+        out.add_header("Link", link);
     }
+    History::render(history, since, out, until);
+}
+
+void handle_http_binary(const EthHTTPServer::http_request& req, EthHTTPServer::response_writer& out) {
+    uint8_t body[Prom::max_binary_size];
+    Sampler::update_ages(sampler);
+    int len = Prom::encode_binary(metrics, History::now_seconds(history) + history.epoch_offset, body);
+
+    out.begin(200, "Success", "application/octet-stream", len);
+    out.write(body, len);
+}
+
+void handle_http_schema(const EthHTTPServer::http_request& req, EthHTTPServer::response_writer& out) {
+    out.begin(200, "Success");
+    Prom::render_schema(metrics, out);
+}
+
+void handle_http_log(const EthHTTPServer::http_request& req, EthHTTPServer::response_writer& out) {
+    out.begin(200, "Success");
+    Log::render_tail(out);
+}
 
-    snprintf(
-        response.body,
-        MAX_RESPONSE_LEN,
-        response_template,
-        reading.dht1.humidity,
-        reading.dht1.temp,
-        reading.dht2.humidity,
-        reading.dht2.temp,
-        reading.ph,
-        reading.liquid_temp
-    );
-    Serial.println("Sent metrics");
-    return response;
+void handle_http_loop(const EthHTTPServer::http_request& req, EthHTTPServer::response_writer& out) {
+    out.begin(200, "Success", "text/plain; version=0.0.4; charset=utf-8");
+    LoopProfiler::render(out);
 }
@@ -0,0 +1,109 @@
+/*
+ * Free running pH probe sampling on the RP2040 ADC.
+ *
+ * The ADC converts continuously into its FIFO and a DMA channel drains it
+ * into a ring buffer, so sampling costs no CPU. A read filters the whole
+ * ring: the samples are averaged in blocks, the median block rejects
+ * spikes, and a fixed point EMA smooths across reads.
+ */
+#include <hardware/adc.h>
+#include <hardware/dma.h>
+
+// must be a power of two, the DMA ring wraps on the buffer's alignment
+#ifndef PH_RING_SAMPLES
+#define PH_RING_SAMPLES 1024
+#endif
+
+#ifndef PH_SAMPLE_RATE
+#define PH_SAMPLE_RATE 10000
+#endif
+
+namespace PhAdc {
+    const int block_samples = 32;
+    const int num_blocks = PH_RING_SAMPLES / block_samples;
+    // EMA alpha of 1/4, in Q4 block sums
+    const int ema_shift = 2;
+    const int ema_frac_bits = 4;
+    const uint32_t dma_transfers = 0xFFFFFFFF;
+
+    static uint16_t ring[PH_RING_SAMPLES] __attribute__((aligned(PH_RING_SAMPLES * sizeof(uint16_t))));
+    static int dma_channel = -1;
+    static unsigned long started;
+    static int32_t ema;
+    static bool has_ema = false;
+
+    constexpr uint ring_bits(uint bytes) {
+        return bytes > 1 ? 1 + ring_bits(bytes / 2) : 0;
+    }
+
+    static_assert((PH_RING_SAMPLES & (PH_RING_SAMPLES - 1)) == 0, "PH_RING_SAMPLES must be a power of two");
+    static_assert(ring_bits(sizeof(ring)) <= 15, "PH_RING_SAMPLES is too large for a DMA ring");
+
+    void begin(uint gpio) {
+        adc_init();
+        adc_gpio_init(gpio);
+        adc_select_input(gpio - 26);
+        // enable the FIFO with a DREQ on every sample
+        adc_fifo_setup(true, true, 1, false, false);
+        adc_set_clkdiv(48000000.0f / PH_SAMPLE_RATE - 1);
+
+        dma_channel = dma_claim_unused_channel(true);
+        dma_channel_config config = dma_channel_get_default_config(dma_channel);
+        channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+        channel_config_set_read_increment(&config, false);
+        channel_config_set_write_increment(&config, true);
+        channel_config_set_ring(&config, true, ring_bits(sizeof(ring)));
+        channel_config_set_dreq(&config, DREQ_ADC);
+        dma_channel_configure(dma_channel, &config, ring, &adc_hw->fifo, dma_transfers, true);
+
+        adc_run(true);
+        started = millis();
+    }
+
+    /*
+     * Until the ring has filled once its older samples are still zero.
+     */
+    bool ready() {
+        return dma_channel >= 0 && millis() - started > 2 * PH_RING_SAMPLES * 1000UL / PH_SAMPLE_RATE;
+    }
+
+    void sort(uint32_t* values, int n) {
+        for (int i = 1; i < n; i++) {
+            uint32_t v = values[i];
+            int j = i;
+            for (; j > 0 && values[j - 1] > v; j--)
+                values[j] = values[j - 1];
+            values[j] = v;
+        }
+    }
+
+    /*
+     * Filtered reading in 12 bit ADC counts.
+     */
+    float read() {
+        // a transfer count lasts days, but it does run out
+        if (!dma_channel_is_busy(dma_channel))
+            dma_channel_set_trans_count(dma_channel, dma_transfers, true);
+
+        uint32_t sums[num_blocks];
+        for (int block = 0; block < num_blocks; block++) {
+            const uint16_t* samples = ring + block * block_samples;
+            uint32_t sum = 0;
+            for (int i = 0; i < block_samples; i++)
+                sum += samples[i] & 0xFFF;
+            sums[block] = sum;
+        }
+
+        sort(sums, num_blocks);
+        int32_t median = (int32_t) sums[num_blocks / 2] << ema_frac_bits;
+
+        if (has_ema) {
+            ema += (median - ema) >> ema_shift;
+        } else {
+            ema = median;
+            has_ema = true;
+        }
+
+        return ema / (float) (block_samples << ema_frac_bits);
+    }
+}
@@ -1,24 +1,21 @@
-// REQUIRES the following Arduino libraries:
-// - DHT Sensor Library: https://github.com/adafruit/DHT-sensor-library
-// - Adafruit Unified Sensor Lib: https://github.com/adafruit/Adafruit_Sensor
-
-#include <Adafruit_Sensor.h>
-#include <DHT.h>
-#include <DHT_U.h>
 #include <pico/stdlib.h>
 #include <hardware/gpio.h>
 #include "pico-onewire/api/one_wire.h"
 #include "pico-onewire/source/one_wire.cpp"
+#include "dht_async.h"
+#include "ph_adc.h"
 
 
 #define DHT1_PIN 22
 #define DHT2_PIN 21
 #define ONE_WIRE_BUS 20
+#define MAX_PROBES 4
 #define PH_PIN A2
+#define PH_CALIBRATION_TEMP 25.0
 #define SENSOR_SLOPE -0.00563
 
-DHT_Unified dht1(DHT1_PIN, DHT22);
-DHT_Unified dht2(DHT2_PIN, DHT22);
+DhtAsync::sensor_t dht1;
+DhtAsync::sensor_t dht2;
 One_wire one_wire(ONE_WIRE_BUS);
 
 struct dht_reading_t {
@@ -27,20 +24,40 @@ struct dht_reading_t {
     bool success;
 };
 
+struct liquid_reading_t {
+    float temp[MAX_PROBES];  // c, NaN for missing probes
+};
+
 struct sensor_reading_t {
     dht_reading_t dht1;
     dht_reading_t dht2;
     float ph;
-    float liquid_temp;
+    liquid_reading_t liquid;
     uint millis;
 };
 
 // PH
 
-float read_ph(bool print) {
-    int raw = analogRead(PH_PIN);
-    float mv = raw / 4096.0 * 3300;  // read milivolts
-    float ph = raw * -0.01802851203 + 15.94402376;
+void setup_ph() {
+    PhAdc::begin(PH_PIN);
+}
+
+/*
+ * The probe's slope scales with absolute temperature around pH 7, correct
+ * it from the calibration temperature when the liquid temperature is known.
+ */
+float compensate_ph(float ph, float liquid_temp) {
+    if (isnan(liquid_temp))
+        return ph;
+
+    return 7 + (ph - 7) * (PH_CALIBRATION_TEMP + 273.15) / (liquid_temp + 273.15);
+}
+
+float read_ph(float liquid_temp, bool print) {
+    // calibrated against analogRead's default 10 bit counts
+    float raw = PhAdc::read() / 4;
+    float mv = raw / 1024.0 * 3300;  // read milivolts
+    float ph = compensate_ph(raw * -0.01802851203 + 15.94402376, liquid_temp);
 
     if (print) {
         Serial.print("Raw read: ");
@@ -58,24 +75,23 @@ float read_ph(bool print) {
 // DHTs
 
 void setup_dht() {
-    dht1.begin();
-    dht2.begin();
-    sensor_t sensor;
-    dht1.temperature().getSensor(&sensor);
+    DhtAsync::begin(dht1, DHT1_PIN);
+    DhtAsync::begin(dht2, DHT2_PIN);
 }
 
-dht_reading_t read_dht(DHT_Unified* dht) {
-    // Get temperature event and print its value.
-    sensors_event_t event;
+/*
+ * Advance a background read, filling out when it completes.
+ */
+DhtAsync::read_status poll_dht(DhtAsync::sensor_t& dht, dht_reading_t& out) {
+    DhtAsync::read_status status = DhtAsync::read(dht);
+    if (status != DhtAsync::read_pending)
+        out = dht_reading_t{dht.temp, dht.humidity, status == DhtAsync::read_ok};
+    return status;
+}
+
+dht_reading_t read_dht(DhtAsync::sensor_t& dht) {
     dht_reading_t result;
-    result.success = true;
-
-    dht->temperature().getEvent(&event);
-    result.temp = event.temperature;
-    result.success &= !isnan(event.temperature);
-    dht->humidity().getEvent(&event);
-    result.humidity = event.relative_humidity;
-    result.success &= !isnan(event.relative_humidity);
+    while (poll_dht(dht, result) == DhtAsync::read_pending);
     return result;
 }
 
@@ -91,15 +107,78 @@ void print_reading(dht_reading_t* reading) {
 
 // temp
 
+/*
+ * DS18B20 probes on the one wire bus. ROMs are enumerated once, and every
+ * probe converts at once from a single skip ROM broadcast. The conversion
+ * is left running and collected on a later poll rather than waited on.
+ */
+struct probe_bus_t {
+    int num_probes;
+    rom_address_t addresses[MAX_PROBES];
+    bool converting;
+    unsigned long conversion_started;
+    unsigned long conversion_ms;
+};
+
+probe_bus_t probes{};
+
+enum probe_status {
+    probes_pending,
+    probes_ok,
+    probes_failed
+};
+
+void find_probes() {
+    int found = one_wire.find_and_count_devices_on_bus();
+    probes.num_probes = found < MAX_PROBES ? found : MAX_PROBES;
+
+    for (int i = 0; i < probes.num_probes; i++)
+        probes.addresses[i] = One_wire::get_address(i);
+}
+
 void setup_temp() {
     one_wire.init();
+    find_probes();
+}
+
+float read_probe(int i) {
+    float temp = one_wire.temperature(probes.addresses[i]);
+    // outside the DS18B20's range is a failed read
+    return temp >= -55 && temp <= 125 ? temp : NAN;
+}
+
+/*
+ * Start a conversion if none is running, otherwise collect it once done.
+ */
+probe_status poll_probes(liquid_reading_t& out) {
+    if (!probes.num_probes) {
+        find_probes();
+        return probes_failed;
+    }
+
+    if (!probes.converting) {
+        probes.conversion_ms = one_wire.convert_temperature(probes.addresses[0], false, true);
+        probes.conversion_started = millis();
+        probes.converting = true;
+        return probes_pending;
+    }
+
+    if (millis() - probes.conversion_started < probes.conversion_ms)
+        return probes_pending;
+
+    probes.converting = false;
+    bool any = false;
+    for (int i = 0; i < MAX_PROBES; i++) {
+        out.temp[i] = i < probes.num_probes ? read_probe(i) : NAN;
+        any |= !isnan(out.temp[i]);
+    }
+    return any ? probes_ok : probes_failed;
 }
 
-float read_liquid_temp() {
-    rom_address_t address{};
-    one_wire.single_device_read_rom(address);
-    one_wire.convert_temperature(address, true, false);
-    return one_wire.temperature(address);
+liquid_reading_t read_liquid_temp() {
+    liquid_reading_t result;
+    while (poll_probes(result) == probes_pending);
+    return result;
 }
 
 
@@ -108,14 +187,16 @@ float read_liquid_temp() {
 void setup_sensors() {
     setup_dht();
     setup_temp();
+    setup_ph();
 }
 
 sensor_reading_t read_sensors(bool print=false) {
+    liquid_reading_t liquid = read_liquid_temp();
     return sensor_reading_t {
-        read_dht(&dht1),
-        read_dht(&dht2),
-        read_ph(true),
-        read_liquid_temp(),
+        read_dht(dht1),
+        read_dht(dht2),
+        read_ph(liquid.temp[0], print),
+        liquid,
         millis(),
     };
 }
@@ -56,8 +56,12 @@ class McuState:
     recovery: bool
 
 
+# reuse one connection to the board for all requests
+MCU_SESSION = requests.Session()
+
+
 def make_mcu_request(endpoint: str) -> McuState:
-    resp = requests.get(f"{MCU_URL}{endpoint}")
+    resp = MCU_SESSION.get(f"{MCU_URL}{endpoint}")
 
     if resp.status_code != requests.codes.ok:
         raise RuntimeError(f"Request {endpoint} failed: {resp.status_code}")
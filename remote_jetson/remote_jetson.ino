@@ -12,6 +12,17 @@ struct pin_state_t {
 
 static pin_state_t pin_state;
 
+struct jetson_config : EthHTTPServer::default_config {
+    static constexpr int max_response_len = 256;
+    static constexpr int max_response_headers = 0;
+    static constexpr int max_routes = 0;
+    static constexpr int max_route_target = 24;
+    static constexpr int max_path_params = 1;
+};
+
+using server_t = EthHTTPServer::Server<jetson_config>;
+static server_t server;
+
 void setup() {
     Serial.begin(115200);
     // while (!Serial) delay(10);
@@ -27,26 +38,27 @@ void setup() {
 }
 
 void loop() {
-    EthHTTPServer::run();
+    server.run();
+    Log::drain();
 }
 
 const char* bool_to_str(bool b) {
   return b ? "true" : "false";
 }
 
-EthHTTPServer::http_response make_state_response() {
+server_t::response make_state_response() {
     static const char* state_template =
         "{\n"
         "  \"power\": %s,\n"
         "  \"recovery\": %s\n"
         "}\n";
-    EthHTTPServer::http_response response {
+    server_t::response response {
       .content_type = "application/json; charset=utf-8"
     };
 
     snprintf(
         response.body,
-        256,
+        sizeof(response.body),
         state_template,
         bool_to_str(pin_state.power),
         bool_to_str(pin_state.recovery)
@@ -65,13 +77,23 @@ void blink() {
     digitalWrite(LED_BUILTIN, LOW);
 }
 
-EthHTTPServer::http_response blink_and_respond() {
+server_t::response blink_and_respond() {
     blink();
     return make_state_response();
 }
 
 // Setup / run
 
+ETH_STATIC_RESPONSE(root_response, "200 Success", "text/plain; charset=utf-8", "Jetson remote control.\n");
+
+static const server_t::static_route routes[] PROGMEM = {
+    ETH_ROUTE(HTTP_GET, "/", &root_response),
+    ETH_ROUTE(HTTP_GET, "/state", &http_state),
+    ETH_ROUTE(HTTP_GET, "/power/{state}", &http_power),
+    ETH_ROUTE(HTTP_GET, "/recovery/{state}", &http_recovery),
+    ETH_ROUTE(HTTP_GET, "/press_power_btn", &http_press_power_btn),
+};
+
 void setup_server() {
     EthHTTPServer::setup(EthHTTPServer::EthServerConfig{
       .pin_rx = 0,
@@ -79,49 +101,43 @@ void setup_server() {
       .pin_cs = 1,
       .pin_sck = 2,
     });
-    EthHTTPServer::add_endpoint("/", &handle_http_root);
-    EthHTTPServer::add_endpoint("/state", &http_state);
-    EthHTTPServer::add_endpoint("/power/on", &http_power_on);
-    EthHTTPServer::add_endpoint("/power/off", &http_power_off);
-    EthHTTPServer::add_endpoint("/recovery/on", &http_recovery_on);
-    EthHTTPServer::add_endpoint("/recovery/off", &http_recovery_off);
-    EthHTTPServer::add_endpoint("/press_power_btn", &http_press_power_btn);
+    server.begin();
+    server.set_routes(routes);
 }
 
-EthHTTPServer::http_response handle_http_root(const EthHTTPServer::http_request&) {
-    static const char* msg = "Jetson remote control.\n";
-    EthHTTPServer::http_response response;
-    snprintf(response.body, 256, msg);
-    return response;
-}
-
-EthHTTPServer::http_response http_state(const EthHTTPServer::http_request&) {
+server_t::response http_state(const EthHTTPServer::http_request&) {
     return blink_and_respond();
 }
 
-EthHTTPServer::http_response http_power_on(const EthHTTPServer::http_request&) {
-    set_pin(POWER_PIN, pin_state.power, true);
+server_t::response http_press_power_btn(const EthHTTPServer::http_request&) {
+    digitalWrite(POWER_BTN, HIGH);
+    delay(350);
+    digitalWrite(POWER_BTN, LOW);
     return blink_and_respond();
 }
 
-EthHTTPServer::http_response http_power_off(const EthHTTPServer::http_request&) {
-    set_pin(POWER_PIN, pin_state.power, false);
-    return blink_and_respond();
+server_t::response bad_state() {
+    server_t::response response{};
+    response.code = 400;
+    strcpy(response.code_msg, "Bad Request");
+    strcpy(response.body, "state must be on or off\n");
+    return response;
 }
 
-EthHTTPServer::http_response http_press_power_btn(const EthHTTPServer::http_request&) {
-    digitalWrite(POWER_BTN, HIGH);
-    delay(350);
-    digitalWrite(POWER_BTN, LOW);
+// "/power/{state}" and "/recovery/{state}"
+server_t::response set_pin_from_path(const EthHTTPServer::http_request& req, int pin_num, bool& pin) {
+    EthHTTPServer::str_view state = EthHTTPServer::find_path_param(req, "state");
+    if (!state.equals("on") && !state.equals("off"))
+        return bad_state();
+
+    set_pin(pin_num, pin, state.equals("on"));
     return blink_and_respond();
 }
 
- EthHTTPServer::http_response http_recovery_on(const EthHTTPServer::http_request&) {
-     set_pin(REC_PIN, pin_state.recovery, true);
-     return blink_and_respond();
- }
+server_t::response http_power(const EthHTTPServer::http_request& req) {
+    return set_pin_from_path(req, POWER_PIN, pin_state.power);
+}
 
- EthHTTPServer::http_response http_recovery_off(const EthHTTPServer::http_request&) {
-     set_pin(REC_PIN, pin_state.recovery, false);
-     return blink_and_respond();
+server_t::response http_recovery(const EthHTTPServer::http_request& req) {
+    return set_pin_from_path(req, REC_PIN, pin_state.recovery);
 }
@@ -0,0 +1,216 @@
+/*
+ * Non-blocking DHT22 reads.
+ *
+ * The start pulse is timed from poll() instead of delay(), and the 40 bit
+ * frame is captured by a falling edge interrupt recording micros(), so
+ * nothing spins with interrupts off. Every bit starts with a ~50us low, so
+ * the time between falling edges is ~76us for a 0 and ~120us for a 1.
+ *
+ *   static DhtAsync::sensor_t dht;
+ *   DhtAsync::begin(dht, pin);
+ *   ...
+ *   if (DhtAsync::read(dht) == DhtAsync::read_ok)    // from loop()
+ *       use(dht.temp, dht.humidity);
+ */
+#include <Arduino.h>
+
+#ifndef IRAM_ATTR
+#define IRAM_ATTR
+#endif
+
+// at most 4, one interrupt trampoline each
+#ifndef DHT_MAX_SENSORS
+#define DHT_MAX_SENSORS 2
+#endif
+
+namespace DhtAsync {
+    // response edge, 40 bit edges and the end of frame edge
+    const int frame_edges = 42;
+    const unsigned long start_pulse_us = 1100;
+    const unsigned long frame_timeout_us = 10000;
+    const unsigned long bit_threshold_us = 100;
+    // the sensor can't be read more often than this
+    const unsigned long min_interval_ms = 2000;
+
+    enum read_state : uint8_t {
+        state_idle,
+        state_start,
+        state_receiving
+    };
+
+    enum read_status : uint8_t {
+        read_pending,
+        read_ok,
+        read_failed
+    };
+
+    struct sensor_t {
+        uint8_t pin;
+        read_state state;
+        volatile uint8_t edges;
+        volatile uint32_t edge_times[frame_edges];
+        unsigned long started;     // micros, start of the current stage
+        unsigned long last_read;   // millis
+        float temp;  // c
+        float humidity;
+    };
+
+    static sensor_t* sensors[DHT_MAX_SENSORS];
+    static int num_sensors = 0;
+
+    void IRAM_ATTR on_edge(sensor_t& sensor) {
+        uint8_t n = sensor.edges;
+        if (n < frame_edges) {
+            sensor.edge_times[n] = micros();
+            sensor.edges = n + 1;
+        }
+    }
+
+    template<int N>
+    void IRAM_ATTR edge_isr() {
+        on_edge(*sensors[N]);
+    }
+
+    static void (* const edge_isrs[])() = {
+        &edge_isr<0>, &edge_isr<1>, &edge_isr<2>, &edge_isr<3>
+    };
+
+    static_assert(DHT_MAX_SENSORS <= sizeof(edge_isrs) / sizeof(edge_isrs[0]),
+                  "DHT_MAX_SENSORS exceeds the available interrupt trampolines");
+
+    /*
+     * Pass settled when the sensor stayed powered while the MCU didn't, e.g.
+     * waking from deep sleep, to skip the power up interval.
+     */
+    bool begin(sensor_t& sensor, uint8_t pin, bool settled = false) {
+        if (num_sensors >= DHT_MAX_SENSORS)
+            return false;
+
+        sensor = sensor_t{};
+        sensor.pin = pin;
+        sensor.temp = NAN;
+        sensor.humidity = NAN;
+        // the sensor also needs the interval to settle after power up
+        sensor.last_read = settled ? millis() - min_interval_ms : millis();
+        sensors[num_sensors++] = &sensor;
+        pinMode(pin, INPUT_PULLUP);
+        return true;
+    }
+
+    int isr_index(const sensor_t& sensor) {
+        for (int i = 0; i < num_sensors; i++) {
+            if (sensors[i] == &sensor)
+                return i;
+        }
+        return -1;
+    }
+
+    /*
+     * Start a read, false if one is running or the last was too recent.
+     */
+    bool start(sensor_t& sensor) {
+        if (sensor.state != state_idle)
+            return false;
+        if (millis() - sensor.last_read < min_interval_ms)
+            return false;
+
+        sensor.edges = 0;
+        sensor.started = micros();
+        sensor.state = state_start;
+        pinMode(sensor.pin, OUTPUT);
+        digitalWrite(sensor.pin, LOW);
+        return true;
+    }
+
+    /*
+     * Decode the bits from the last 41 edges, so a missed response edge
+     * doesn't shift the frame.
+     */
+    bool decode(sensor_t& sensor) {
+        int edges = sensor.edges;
+        if (edges < frame_edges - 1)
+            return false;
+
+        uint8_t data[5] = {};
+        int first = edges - (frame_edges - 1);
+        for (int bit = 0; bit < 40; bit++) {
+            uint32_t width = sensor.edge_times[first + bit + 1] - sensor.edge_times[first + bit];
+            data[bit / 8] = (data[bit / 8] << 1) | (width > bit_threshold_us);
+        }
+
+        if ((uint8_t) (data[0] + data[1] + data[2] + data[3]) != data[4])
+            return false;
+
+        sensor.humidity = ((data[0] << 8) | data[1]) * 0.1f;
+        sensor.temp = (((data[2] & 0x7F) << 8) | data[3]) * 0.1f;
+        if (data[2] & 0x80)
+            sensor.temp = -sensor.temp;
+
+        return true;
+    }
+
+    /*
+     * Advance the current read, read_pending until the frame is in.
+     */
+    read_status poll(sensor_t& sensor) {
+        switch (sensor.state) {
+        case state_idle:
+            return read_failed;
+
+        case state_start:
+            if (micros() - sensor.started < start_pulse_us)
+                return read_pending;
+
+            // listen before releasing the line, the sensor answers within 40us
+            attachInterrupt(digitalPinToInterrupt(sensor.pin), edge_isrs[isr_index(sensor)], FALLING);
+            pinMode(sensor.pin, INPUT_PULLUP);
+            sensor.started = micros();
+            sensor.state = state_receiving;
+            return read_pending;
+
+        case state_receiving:
+            if (sensor.edges < frame_edges && micros() - sensor.started < frame_timeout_us)
+                return read_pending;
+
+            detachInterrupt(digitalPinToInterrupt(sensor.pin));
+            sensor.state = state_idle;
+            sensor.last_read = millis();
+            return decode(sensor) ? read_ok : read_failed;
+        }
+        return read_failed;
+    }
+
+    /*
+     * Start a read when the sensor allows it and poll it to completion.
+     */
+    read_status read(sensor_t& sensor) {
+        if (sensor.state == state_idle && !start(sensor))
+            return read_pending;
+
+        return poll(sensor);
+    }
+
+    /*
+     * Apparent temperature in celsius, the NWS formula.
+     */
+    float heat_index(float temp, float humidity) {
+        float t = temp * 1.8f + 32;
+        float hi = 0.5f * (t + 61.0f + ((t - 68.0f) * 1.2f) + (humidity * 0.094f));
+
+        if (hi > 79) {
+            hi = -42.379f + 2.04901523f * t + 10.14333127f * humidity
+                - 0.22475541f * t * humidity - 0.00683783f * t * t
+                - 0.05481717f * humidity * humidity
+                + 0.00122874f * t * t * humidity
+                + 0.00085282f * t * humidity * humidity
+                - 0.00000199f * t * t * humidity * humidity;
+
+            if (humidity < 13 && t >= 80 && t <= 112)
+                hi -= ((13 - humidity) * 0.25f) * sqrtf((17 - fabsf(t - 95)) * 0.05882f);
+            else if (humidity > 85 && t >= 80 && t <= 87)
+                hi += ((humidity - 85) * 0.1f) * ((87 - t) * 0.2f);
+        }
+
+        return (hi - 32) / 1.8f;
+    }
+}
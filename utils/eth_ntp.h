@@ -0,0 +1,115 @@
+/*
+ * Minimal SNTP client over EthernetUDP, for boards without the ESP8266's
+ * configTime.
+ *
+ *   #include "log_ring.h"    // for LOG, eth_server.h brings it in too
+ *   static EthNtp::client_t ntp;
+ *   EthNtp::begin(ntp);          // once Ethernet is up
+ *   ...
+ *   uint32_t now;
+ *   if (EthNtp::run(ntp, now))   // in loop(), true when a reply came in
+ *       History::set_wall_clock(history, now);
+ *
+ * A request goes out every NTP_SYNC_EVERY ms, or NTP_RETRY_EVERY until the
+ * first answer, and the reply is picked up by a later run(), so loop() never
+ * waits on the server. Resolving NTP_SERVER can still block for the DNS
+ * lookup, once per request.
+ */
+#include <Arduino.h>
+#include <Ethernet.h>
+#include <EthernetUdp.h>
+
+#ifndef NTP_SERVER
+#define NTP_SERVER "pool.ntp.org"
+#endif
+
+#ifndef NTP_SYNC_EVERY
+#define NTP_SYNC_EVERY 3600000UL
+#endif
+
+#ifndef NTP_RETRY_EVERY
+#define NTP_RETRY_EVERY 10000UL
+#endif
+
+#ifndef NTP_LOCAL_PORT
+#define NTP_LOCAL_PORT 8123
+#endif
+
+namespace EthNtp {
+    const int packet_size = 48;
+    // seconds from the NTP epoch (1900) to the Unix one
+    const uint32_t unix_offset = 2208988800UL;
+
+    struct client_t {
+        EthernetUDP udp;
+        unsigned long sent_at = 0;
+        bool sent = false;
+        bool synced = false;
+    };
+
+    void begin(client_t& ntp) {
+        ntp.udp.begin(NTP_LOCAL_PORT);
+    }
+
+    bool send_request(client_t& ntp) {
+        uint8_t packet[packet_size] = {};
+        // leap indicator unknown, version 4, client mode
+        packet[0] = 0xE3;
+
+        if (!ntp.udp.beginPacket(NTP_SERVER, 123))
+            return false;
+
+        ntp.udp.write(packet, sizeof(packet));
+        return ntp.udp.endPacket();
+    }
+
+    /*
+     * Parse a server reply into Unix seconds, rounded. False for anything
+     * that isn't a usable answer, including kiss-of-death packets.
+     */
+    bool parse_reply(const uint8_t* packet, uint32_t& unix_time) {
+        bool server_mode = (packet[0] & 0x07) == 4;
+        bool has_stratum = packet[1] != 0;
+        if (!server_mode || !has_stratum)
+            return false;
+
+        // transmit timestamp, whole seconds then the fraction
+        uint32_t secs = (uint32_t) packet[40] << 24 | (uint32_t) packet[41] << 16
+            | (uint32_t) packet[42] << 8 | packet[43];
+        if (packet[44] & 0x80)
+            secs++;
+
+        if (secs < unix_offset)
+            return false;
+
+        unix_time = secs - unix_offset;
+        return true;
+    }
+
+    /*
+     * Send a request when one is due and pick up any reply. Returns true
+     * with unix_time set when a reply came in.
+     */
+    bool run(client_t& ntp, uint32_t& unix_time) {
+        if (ntp.udp.parsePacket() >= packet_size) {
+            uint8_t packet[packet_size];
+            ntp.udp.read(packet, sizeof(packet));
+            if (parse_reply(packet, unix_time)) {
+                ntp.synced = true;
+                return true;
+            }
+        }
+
+        unsigned long now = millis();
+        unsigned long every = ntp.synced ? NTP_SYNC_EVERY : NTP_RETRY_EVERY;
+        if (ntp.sent && now - ntp.sent_at < every)
+            return false;
+
+        // a failed send waits for the next slot too, DNS may be down
+        ntp.sent = true;
+        ntp.sent_at = now;
+        if (!send_request(ntp))
+            LOG("NTP request failed");
+        return false;
+    }
+}
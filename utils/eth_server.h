@@ -1,47 +1,79 @@
 #include <SPI.h>
 #include <Ethernet.h>
+#include "response_cache.h"
+#include "log_ring.h"
 
-#ifndef ETH_SERVER_PORT
-#define ETH_SERVER_PORT 80
-#endif
-
-#ifndef ETH_DISABLE_BODY
-#ifndef ETH_MAX_RESPONSE_LEN
-#define ETH_MAX_RESPONSE_LEN 2048
-#endif
-
-#ifndef ETH_MAX_REQUEST_BODY
-#define ETH_MAX_REQUEST_BODY 2048
-#endif
-#else
+/*
+ * Each server is a global Server<Config>, where Config says how big
+ * everything is. Every buffer and table is sized from it at compile time
+ * and lives inside the object, so a server's RAM shows up as that one
+ * symbol in the link map. Features sized 0 (headers, bodies, added routes)
+ * or switched off (the not found handler, instrumentation) take no space.
+ *
+ *   struct control_config : EthHTTPServer::default_config {
+ *       static constexpr uint16_t port = 8080;
+ *       static constexpr int max_headers = 0;
+ *   };
+ *   static EthHTTPServer::Server<control_config> control;
+ *   ...
+ *   EthHTTPServer::setup(hardware);   // SPI and the W5500, once
+ *   control.begin();
+ *   control.add_endpoint("/power", &handle_power);
+ *   ...
+ *   control.run();                    // in loop()
+ *
+ * Several servers can run side by side on different ports, as long as
+ * their connections together fit in the W5500's eight sockets.
+ */
+namespace EthHTTPServer {
+    struct default_config {
+        static constexpr uint16_t port = 80;
 
-#define ETH_MAX_REQUEST_BODY 0
-#define ETH_MAX_RESPONSE_LEN 0
+        // sockets served at once, the parse buffer is split evenly between them
+        static constexpr int max_connections = 4;
+        static constexpr int parse_buffer_size = 4096;
 
-#endif
+        // request headers indexed for find_header, 0 drops them unparsed
+        static constexpr int max_headers = 10;
+        // names of the only headers find_header returns, all of them when
+        // the list is empty. Point it at an array at namespace scope:
+        //   static const char* const wanted_headers[] = {"If-None-Match"};
+        //   static constexpr const char* const* header_whitelist = wanted_headers;
+        //   static constexpr int header_whitelist_len = 1;
+        static constexpr const char* const* header_whitelist = nullptr;
+        static constexpr int header_whitelist_len = 0;
+        // 0 drops request bodies instead of buffering them
+        static constexpr int max_request_body = 2048;
 
-#ifndef ETH_DISABLE_HEADERS
-#ifndef ETH_MAX_HEADERS
-#define ETH_MAX_HEADERS 10
-#endif
-#else
-#define ETH_MAX_HEADERS 0
-#endif
+        // the response type returned by buffered handlers
+        static constexpr int max_response_len = 2048;
+        static constexpr int max_response_headers = 10;
 
-#ifndef ETH_MAX_ROUTES
-#define ETH_MAX_ROUTES 32
-#endif
+        // routes added at run time, set_routes() tables stay in flash
+        static constexpr int max_routes = 32;
+        static constexpr int max_route_target = 64;
+        // captures kept from a pattern route's {name} segments
+        static constexpr int max_path_params = 4;
+        static constexpr bool not_found_handler = true;
 
-#ifndef ETH_MAX_ROUTE_TARGET
-#define ETH_MAX_ROUTE_TARGET 64
-#endif
+        // responses go out to the socket in blocks of this size
+        static constexpr int write_block_size = 512;
 
-#ifndef ETH_PARSE_BUFFER_SIZE
-#define ETH_PARSE_BUFFER_SIZE 4096
-#endif
+        static constexpr unsigned long request_timeout_ms = 2000;
+        // persistent connections: idle time allowed between requests and the
+        // number of requests served before the connection is closed anyway
+        static constexpr unsigned long keepalive_timeout_ms = 5000;
+        static constexpr int max_keepalive_requests = 16;
+        // how long stop() may wait for the peer to acknowledge our FIN
+        static constexpr unsigned long close_timeout_ms = 10;
 
-namespace EthHTTPServer {
-    char buffer[ETH_PARSE_BUFFER_SIZE];
+        // count requests and time each phase per route, served in Prometheus
+        // format at debug_metrics_path
+        static constexpr bool instrumentation = false;
+        static constexpr const char* debug_metrics_path = "/debug/metrics";
+        // routes tracked individually, any beyond are counted together
+        static constexpr int stats_max_routes = 16;
+    };
 
     struct EthServerConfig {
         byte mac[12] = {0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED};
@@ -54,247 +86,982 @@ namespace EthHTTPServer {
         #endif
     };
 
-    static EthernetServer server(ETH_SERVER_PORT);
+    /*
+     * A fixed array, empty when N is 0. The empty one can't be indexed,
+     * code that has to build either way goes through data(), which is null.
+     */
+    template<typename T, int N>
+    struct storage_t {
+        T items[N];
+
+        T& operator[](int i) { return items[i]; }
+        const T& operator[](int i) const { return items[i]; }
+        T* data() { return items; }
+        const T* data() const { return items; }
+    };
+
+    template<typename T>
+    struct storage_t<T, 0> {
+        T* data() { return nullptr; }
+        const T* data() const { return nullptr; }
+    };
+
+    /*
+     * A (pointer, length) slice of the parse buffer. Only valid until the
+     * handler returns, the buffer is reused for the next request.
+     */
+    struct str_view {
+        const char* data;
+        int len;
+
+        bool equals(const char* s) const {
+            return (int) strlen(s) == len && (!len || !memcmp(data, s, len));
+        }
+
+        bool iequals(const char* s) const {
+            return (int) strlen(s) == len && (!len || !strncasecmp(data, s, len));
+        }
+
+        // false unless the view is all decimal digits
+        bool to_uint(uint32_t& out) const {
+            out = 0;
+            for (int i = 0; i < len; i++) {
+                if (data[i] < '0' || data[i] > '9')
+                    return false;
+                out = out * 10 + (data[i] - '0');
+            }
+            return len > 0;
+        }
+    };
 
     struct http_header {
         char name[64];
         char data[64];
     };
 
+    struct header_view {
+        str_view name;
+        str_view value;
+    };
+
+    enum http_method : uint8_t {
+        HTTP_ANY,
+        HTTP_GET,
+        HTTP_HEAD,
+        HTTP_POST,
+        HTTP_PUT,
+        HTTP_DELETE,
+        HTTP_OTHER
+    };
+
+    /*
+     * method, target and protocol are null terminated in place so they can
+     * also be used as C strings. The query is split off the target, without
+     * its '?'. Headers stay as one raw block until the first find_header
+     * call indexes them into the connection's header slots. When a pattern
+     * route matched, its captures are views into the target.
+     */
     struct http_request {
-        bool valid = true;
         int content_length = 0;
-        char method[16];
-        char protocol[16];
-        char target[64];
-        int num_headers = 0;
-        http_header headers[ETH_MAX_HEADERS];
-        char body[ETH_MAX_REQUEST_BODY];
+        bool keep_alive = false;
+        http_method method_id = HTTP_OTHER;
+        str_view method{};
+        str_view target{};
+        str_view query{};
+        str_view protocol{};
+        str_view header_block{};
+        str_view body{};
+
+        mutable int num_headers = -1;
+        header_view* headers = nullptr;
+        int max_headers = 0;
+        const char* const* header_whitelist = nullptr;
+        int header_whitelist_len = 0;
+
+        // the matched route's target, for find_path_param
+        const char* route_pattern = nullptr;
+        bool pattern_in_flash = false;
+        const str_view* path_params = nullptr;
+        int num_path_params = 0;
     };
 
-    struct http_response {
+    template<int MaxBody, int MaxHeaders>
+    struct basic_http_response {
         int code = 200;
         char code_msg[32] = "Success";
         char content_type[32] = "text/plain; charset=utf-8";
-        http_header headers[ETH_MAX_HEADERS];
+        storage_t<http_header, MaxHeaders> headers;
         int num_headers = 0;
-        char body[ETH_MAX_RESPONSE_LEN];
+        // room for the terminator even when there's no body
+        char body[MaxBody > 0 ? MaxBody : 1] = "";
     };
 
-    using route_func_t = http_response (*)(const http_request&);
+    // histogram bucket bounds in microseconds, +Inf is implied
+    static const uint32_t latency_bounds_us[] = {100, 500, 1000, 5000, 10000, 50000, 100000, 500000};
+    const int num_latency_buckets = sizeof(latency_bounds_us) / sizeof(latency_bounds_us[0]) + 1;
 
-    struct route_t {
-        route_func_t func = nullptr;
-        char target[ETH_MAX_ROUTE_TARGET];
+    /*
+     * Where a request's time goes: parsing it, the handler (rendering, and
+     * whatever it reads), and writing the response out over SPI.
+     */
+    enum request_phase : uint8_t {
+        phase_parse,
+        phase_handler,
+        phase_write,
+        num_phases
     };
 
-    struct route_table_t {
-        int num_routes = 0;
-        route_t not_found;
-        route_t routes[ETH_MAX_ROUTES];
+    struct histogram_t {
+        uint32_t counts[num_latency_buckets];
+        uint64_t sum_us;
     };
 
-    static route_table_t route_table;
+    void observe(histogram_t& hist, uint32_t us) {
+        int bucket = 0;
+        while (bucket < num_latency_buckets - 1 && us > latency_bounds_us[bucket])
+            bucket++;
+        hist.counts[bucket]++;
+        hist.sum_us += us;
+    }
+
+    // what the response writer saw of the response being sent
+    struct response_stats_t {
+        int status;
+        uint32_t bytes_out;
+        uint32_t write_us;
+    };
+
+    /*
+     * Streams a response straight to the socket. Output is staged in the
+     * server's output block and written one block per client.write call.
+     * When the content length isn't given to begin(), the body goes out
+     * with Transfer-Encoding: chunked, one chunk per block.
+     *
+     * Usage: begin(), any add_header() calls, body writes, end().
+     */
+    class response_writer : public Print {
+        // chunk size is written as fixed width hex so the header can be
+        // reserved before the chunk is filled
+        static const int chunk_head = 6;
+        static const int chunk_tail = 2;
+
+        EthernetClient& client;
+        char* out_buffer;
+        int block_size;
+        // only given when the server is instrumented
+        response_stats_t* stats;
+        int used = 0;
+        int chunk_start = -1;
+        bool started = false;
+        bool in_body = false;
+        bool chunked = false;
+        bool keep_alive = false;
+        // false for HTTP/1.0 clients, which don't know chunked encoding
+        bool chunked_ok = true;
+        bool close_delimited = false;
+        unsigned long sent = 0;
+
+        int capacity() const {
+            return block_size - (chunked && in_body ? chunk_tail : 0);
+        }
+
+        void append(const char* data, int len, bool progmem = false) {
+            while (len > 0) {
+                if (used >= capacity())
+                    flush();
+
+                int space = capacity() - used;
+                int n = len < space ? len : space;
+                if (progmem)
+                    memcpy_P(out_buffer + used, data, n);
+                else
+                    memcpy(out_buffer + used, data, n);
+                used += n;
+                data += n;
+                len -= n;
+            }
+        }
+
+        // nothing a flush would make room by sending, not even the headers
+        bool block_empty() const {
+            return used == (chunked ? chunk_head : 0);
+        }
+
+        // write out the block as it stands, chunk framing is the caller's
+        void send_block() {
+            if (used > 0) {
+                if (stats) {
+                    unsigned long write_started = micros();
+                    client.write((const uint8_t*) out_buffer, used);
+                    stats->write_us += micros() - write_started;
+                    stats->bytes_out += used;
+                } else {
+                    client.write((const uint8_t*) out_buffer, used);
+                }
+                sent += used;
+            }
+            used = 0;
+        }
+
+        void start_chunk() {
+            // the head and the tail have to fit around at least one byte,
+            // or what's there (the end of the headers) goes out first
+            if (used + chunk_head + chunk_tail >= block_size)
+                send_block();
+
+            chunk_start = used;
+            used += chunk_head;
+        }
+
+        void close_chunk() {
+            int len = used - chunk_start - chunk_head;
+            if (len == 0) {
+                // nothing in this chunk, drop the reserved head
+                used = chunk_start;
+                return;
+            }
+
+            char head[chunk_head + 1];
+            snprintf(head, sizeof(head), "%04x\r\n", len);
+            memcpy(out_buffer + chunk_start, head, chunk_head);
+            memcpy(out_buffer + used, "\r\n", chunk_tail);
+            used += chunk_tail;
+        }
+
+        void end_headers() {
+            if (!started)
+                begin(200, "Success");
+            append("\r\n\r\n", 4);
+            in_body = true;
+            if (chunked)
+                start_chunk();
+        }
+
+    public:
+        response_writer(
+            EthernetClient& client,
+            char* out_buffer,
+            int block_size,
+            bool keep_alive = false,
+            bool chunked_ok = true,
+            response_stats_t* stats = nullptr
+        ) : client(client), out_buffer(out_buffer), block_size(block_size), stats(stats), keep_alive(keep_alive), chunked_ok(chunked_ok) {}
+
+        void begin(
+            int code,
+            const char* code_msg,
+            const char* content_type = "text/plain; charset=utf-8",
+            long content_length = -1
+        ) {
+            // without chunked encoding a body of unknown length runs until
+            // the connection closes
+            if (content_length < 0 && !chunked_ok) {
+                keep_alive = false;
+                close_delimited = true;
+            }
+
+            begin_no_body(code, code_msg);
+            chunked = content_length < 0 && chunked_ok;
+            add_header("Content-Type", content_type);
+
+            if (chunked) {
+                add_header("Transfer-Encoding", "chunked");
+            } else if (content_length >= 0) {
+                char line[24];
+                snprintf(line, sizeof(line), "%ld", content_length);
+                add_header("Content-Length", line);
+            }
+        }
+
+        /*
+         * begin() with the status line and headers already formatted in
+         * flash, e.g. by ETH_STATIC_RESPONSE.
+         */
+        void begin_P(PGM_P head, long content_length) {
+            started = true;
+            chunked = false;
+
+            append(head, strlen_P(head), true);
+            if (stats) {
+                // the status code follows "HTTP/1.1 "
+                stats->status = 0;
+                for (int i = 9; i < 12; i++)
+                    stats->status = stats->status * 10 + pgm_read_byte(head + i) - '0';
+            }
+            add_header("Connection", keep_alive ? "keep-alive" : "close");
+
+            char line[24];
+            snprintf(line, sizeof(line), "%ld", content_length);
+            add_header("Content-Length", line);
+        }
+
+        /*
+         * Status line for a response that never has a body, e.g. a 304.
+         */
+        void begin_no_body(int code, const char* code_msg) {
+            started = true;
+            chunked = false;
+
+            char line[24];
+            int n = snprintf(line, sizeof(line), "HTTP/1.1 %d ", code);
+            append(line, n);
+            if (stats)
+                stats->status = code;
+            append(code_msg, strlen(code_msg));
+            add_header("Connection", keep_alive ? "keep-alive" : "close");
+        }
+
+        void add_header(const char* name, const char* value) {
+            append("\r\n", 2);
+            append(name, strlen(name));
+            append(": ", 2);
+            append(value, strlen(value));
+        }
+
+        size_t write(uint8_t c) override {
+            return write(&c, 1);
+        }
+
+        size_t write(const uint8_t* data, size_t len) override {
+            if (!in_body)
+                end_headers();
+            append((const char*) data, len);
+            return len;
+        }
+
+        using Print::write;
+
+        size_t write_P(PGM_P data, size_t len) {
+            if (!in_body)
+                end_headers();
+            append(data, len, true);
+            return len;
+        }
+
+        /*
+         * Formats straight into the output block. A single call can't
+         * produce more than a block.
+         */
+        size_t printf(const char* format, ...) {
+            if (!in_body)
+                end_headers();
+
+            int n = 0;
+            for (int attempt = 0; attempt < 2; attempt++) {
+                int space = capacity() - used;
+                if (space < 0)
+                    space = 0;
+                va_list args;
+                va_start(args, format);
+                n = vsnprintf(out_buffer + used, space, format, args);
+                va_end(args);
+
+                if (n < 0)
+                    return 0;
+                if (n < space)
+                    break;
+
+                if (block_empty()) {
+                    n = space - 1;
+                    break;
+                }
+                flush();
+            }
+
+            used += n;
+            return n;
+        }
+
+        void flush() {
+            if (chunked && in_body)
+                close_chunk();
+
+            send_block();
+
+            if (chunked && in_body)
+                start_chunk();
+        }
+
+        void end() {
+            if (!in_body)
+                end_headers();
+
+            if (chunked) {
+                close_chunk();
+                chunked = false;
+                append("0\r\n\r\n", 5);
+            }
+            flush();
+        }
+
+        unsigned long bytes_sent() const {
+            return sent;
+        }
+
+        // false once the response has to end by closing the connection
+        bool keeps_alive() const {
+            return keep_alive;
+        }
+
+        // the body has no length, the client sees its end when we close
+        bool body_ends_at_close() const {
+            return close_delimited;
+        }
+    };
+
+    using stream_func_t = void (*)(const http_request&, response_writer&);
+
+    /*
+     * A complete constant response in flash, see ETH_STATIC_RESPONSE.
+     */
+    struct static_response_t {
+        PGM_P head;
+        PGM_P body;
+        uint16_t body_len;
+    };
+
+    /*
+     * Declares a static_response_t called name with its status line,
+     * Content-Type and body stored in flash and the body length worked out
+     * by the compiler. Route to it with &name; it's sent without calling
+     * anything. Use at namespace scope:
+     *
+     *   ETH_STATIC_RESPONSE(health_response, "200 OK", "text/plain", "ok\n");
+     */
+#define ETH_STATIC_RESPONSE(name, status, content_type, body)              \
+    static const char name##_head[] PROGMEM =                              \
+        "HTTP/1.1 " status "\r\nContent-Type: " content_type;             \
+    static const char name##_body[] PROGMEM = body;                        \
+    static const EthHTTPServer::static_response_t name PROGMEM = {         \
+        name##_head, name##_body, sizeof(name##_body) - 1                  \
+    }
+
+    /*
+     * One of a buffered handler, a streaming handler or a static response.
+     * Converts from any of the three, so a handler can be given directly
+     * wherever a route is expected.
+     */
+    template<typename Response>
+    struct basic_route_handler {
+        using route_func_t = Response (*)(const http_request&);
+
+        route_func_t func;
+        stream_func_t stream;
+        const static_response_t* fixed;  // in flash
+
+        constexpr basic_route_handler() : func(nullptr), stream(nullptr), fixed(nullptr) {}
+        constexpr basic_route_handler(route_func_t func) : func(func), stream(nullptr), fixed(nullptr) {}
+        constexpr basic_route_handler(stream_func_t stream) : func(nullptr), stream(stream), fixed(nullptr) {}
+        constexpr basic_route_handler(const static_response_t* fixed) : func(nullptr), stream(nullptr), fixed(fixed) {}
+
+        bool empty() const {
+            return !func && !stream && !fixed;
+        }
+    };
+
+    /*
+     * Routes known at compile time. Declare them with ETH_ROUTE in a
+     * PROGMEM array of the server's static_route and hand it to
+     * set_routes(); the table and its target strings stay in flash and the
+     * lookup key is hashed by the compiler.
+     */
+    template<typename Response, int TargetLen>
+    struct basic_static_route {
+        uint32_t key;
+        http_method method;
+        uint8_t captures;
+        basic_route_handler<Response> handler;
+        char target[TargetLen];
+    };
+
+    // FNV-1a over the target only, the method is checked per entry so one
+    // hash finds both a route's own method and HTTP_ANY
+    constexpr uint32_t fnv1a(const char* s, uint32_t h) {
+        return *s ? fnv1a(s + 1, (h ^ (uint8_t) *s) * 16777619u) : h;
+    }
+
+    constexpr uint32_t route_key(const char* target) {
+        return fnv1a(target, 2166136261u);
+    }
+
+    uint32_t route_key(const str_view& target) {
+        uint32_t h = 2166136261u;
+        for (int i = 0; i < target.len; i++) {
+            h = (h ^ (uint8_t) target.data[i]) * 16777619u;
+        }
+        return h;
+    }
+
+    // {name} segments in a route target, 0 for a plain path
+    constexpr uint8_t count_captures(const char* s) {
+        return *s ? (*s == '{') + count_captures(s + 1) : 0;
+    }
+
+#define ETH_ROUTE(method, target, handler) {                            \
+        EthHTTPServer::route_key(target),                               \
+        EthHTTPServer::method,                                          \
+        EthHTTPServer::count_captures(target),                          \
+        handler,                                                        \
+        target                                                          \
+    }
+
+    char pattern_char(const char* p, bool in_flash) {
+        return in_flash ? pgm_read_byte(p) : *p;
+    }
+
+    /*
+     * Match a target against a route pattern in one pass, e.g.
+     * "/pin/{name}/{state}". A {name} segment matches everything up to the
+     * next '/' and {name:uint} only digits; neither matches nothing. The
+     * first max_params captures are stored as views into the target.
+     */
+    bool match_pattern(
+        const char* pattern,
+        bool in_flash,
+        const str_view& target,
+        str_view* params,
+        int max_params,
+        int& num_params
+    ) {
+        num_params = 0;
+        int i = 0;
+
+        while (true) {
+            char c = pattern_char(pattern++, in_flash);
+
+            if (c == '{') {
+                while ((c = pattern_char(pattern++, in_flash)) && c != '}' && c != ':') {}
+
+                bool digits = false;
+                if (c == ':') {
+                    int type_len = 0;
+                    bool is_uint = true;
+                    while ((c = pattern_char(pattern++, in_flash)) && c != '}') {
+                        is_uint = is_uint && type_len < 4 && "uint"[type_len] == c;
+                        type_len++;
+                    }
+                    // an unknown type never matches
+                    if (!is_uint || type_len != 4)
+                        return false;
+                    digits = true;
+                }
+                if (c != '}')
+                    return false;
+
+                int start = i;
+                while (i < target.len && target.data[i] != '/'
+                       && (!digits || (target.data[i] >= '0' && target.data[i] <= '9')))
+                    i++;
+                if (i == start)
+                    return false;
+
+                if (num_params < max_params)
+                    params[num_params++] = str_view{target.data + start, i - start};
+            }
+            else if (!c) {
+                return i == target.len;
+            }
+            else if (i == target.len || target.data[i++] != c) {
+                return false;
+            }
+        }
+    }
 
     enum parse_stage {
         method,
         target,
         protocol,
         headers,
-        body
+        body,
+        complete
+    };
+
+    enum parse_status {
+        parse_incomplete,
+        parse_complete,
+        parse_error
+    };
+
+    /*
+     * Parser state for one request, kept across partial reads. Bytes
+     * [cursor, len) of buffer have been received but not yet consumed by a
+     * stage; a stage only consumes once its delimiter has arrived.
+     *
+     * Without keep_headers, header lines are dropped as soon as they're
+     * seen, and with a max_body of 0 so is the body. Neither then needs
+     * room in the buffer.
+     */
+    struct request_parser {
+        char* buffer = nullptr;
+        int size = 0;
+        bool keep_headers = true;
+        int max_body = 0;
+        parse_stage stage = parse_stage::method;
+        bool skip_line = false;
+        int len = 0;
+        int cursor = 0;
+        int header_start = 0;
+        int body_received = 0;
+        unsigned long started = 0;
+        uint32_t parse_us = 0;
     };
 
     // helpers
 
-    int find_char(char* data, int len, char c) {
+    int find_char(const char* data, int len, char c) {
         int i = 0;
         while (i < len && data[i] != c) i++;
         return i;
     }
 
-    int find_endline(char* data, int len) {
+    int find_endline(const char* data, int len) {
         return find_char(data, len, '\n');
     }
 
-    int find_whitespace(char* data, int len) {
-        int i = 0;
-        while (i < len) {
-            char c = data[i];
-            if (c == ' ' || c == '\n')
-                break;
-            i++;
+    str_view trim(const char* data, int len) {
+        while (len > 0 && data[0] == ' ') { data++; len--; }
+        while (len > 0 && (data[len - 1] == ' ' || data[len - 1] == '\r')) len--;
+        return str_view{data, len};
+    }
+
+    bool header_wanted(const http_request& req, const str_view& name) {
+        if (!req.header_whitelist_len)
+            return true;
+
+        for (int i = 0; i < req.header_whitelist_len; i++) {
+            if (name.iequals(req.header_whitelist[i]))
+                return true;
+        }
+        return false;
+    }
+
+    void index_headers(const http_request& req) {
+        req.num_headers = 0;
+
+        const char* data = req.header_block.data;
+        int remaining = req.header_block.len;
+        while (remaining > 0 && req.num_headers < req.max_headers) {
+            int ll = find_endline(data, remaining);
+            int name_end = find_char(data, ll, ':');
+
+            if (name_end < ll) {
+                header_view header{
+                    str_view{data, name_end},
+                    trim(data + name_end + 1, ll - name_end - 1)
+                };
+                if (header_wanted(req, header.name))
+                    req.headers[req.num_headers++] = header;
+            }
+
+            data += ll + 1;
+            remaining -= ll + 1;
         }
-        return i;
     }
 
     /*
-     * Copy with null terminator added on
+     * Case insensitive header lookup. The header block is indexed on the
+     * first call, so requests whose handler never asks cost nothing.
      */
-    void cpy(char* dest, char* src, int count) {
-        memcpy(dest, src, count);
-        dest[count] = '\0';
+    str_view find_header(const http_request& req, const char* name) {
+        if (req.num_headers < 0)
+            index_headers(req);
+
+        for (int i = 0; i < req.num_headers; i++) {
+            if (req.headers[i].name.iequals(name))
+                return req.headers[i].value;
+        }
+        return str_view{};
+    }
+
+    /*
+     * Split the next name=value pair off the front of query. For handlers
+     * that want every parameter:
+     *
+     *   str_view rest = req.query, name, value;
+     *   while (next_query_param(rest, name, value)) ...
+     */
+    bool next_query_param(str_view& query, str_view& name, str_view& value) {
+        if (query.len <= 0)
+            return false;
+
+        int pair_len = find_char(query.data, query.len, '&');
+        int eq_i = find_char(query.data, pair_len, '=');
+        name = str_view{query.data, eq_i};
+        value = str_view{query.data + eq_i + 1, eq_i < pair_len ? pair_len - eq_i - 1 : 0};
+
+        query.data += pair_len + 1;
+        query.len -= pair_len + 1;
+        return true;
+    }
+
+    /*
+     * Value of a query parameter, empty when it isn't given.
+     */
+    str_view find_query_param(const http_request& req, const char* name) {
+        str_view rest = req.query, key, value;
+        while (next_query_param(rest, key, value)) {
+            if (key.equals(name))
+                return value;
+        }
+        return str_view{};
+    }
+
+    /*
+     * Value of the matched route's {name} capture, empty when there's no
+     * such capture.
+     */
+    str_view find_path_param(const http_request& req, const char* name) {
+        const char* p = req.route_pattern;
+        int index = 0;
+        char c;
+
+        while (p && (c = pattern_char(p++, req.pattern_in_flash))) {
+            if (c != '{')
+                continue;
+
+            const char* n = name;
+            while (*n && pattern_char(p, req.pattern_in_flash) == *n) {
+                p++;
+                n++;
+            }
+            c = pattern_char(p, req.pattern_in_flash);
+            if (!*n && (c == '}' || c == ':'))
+                return index < req.num_path_params ? req.path_params[index] : str_view{};
+            index++;
+        }
+        return str_view{};
+    }
+
+    http_method parse_method(const str_view& method) {
+        static const char* const names[] = {"GET", "HEAD", "POST", "PUT", "DELETE"};
+        for (int i = 0; i < 5; i++) {
+            if (method.equals(names[i]))
+                return (http_method) (HTTP_GET + i);
+        }
+        return HTTP_OTHER;
     }
 
-    int read_all(EthernetClient& client, char* buffer, int max) {
+    int read_available(EthernetClient& client, char* dest, int max) {
         int avail = client.available();
         int len = max < avail ? max : avail;
-        int i = 0;
-        for (; i < len; i++) buffer[i] = client.read();
-        return i > 0 ? i + 1 : 0;
+        if (len <= 0)
+            return 0;
+
+        int n = client.read((uint8_t*) dest, len);
+        return n > 0 ? n : 0;
     }
 
-    http_request parse_request(EthernetClient& client) {
-        int len = read_all(client, buffer, ETH_PARSE_BUFFER_SIZE);
+    void reset_parser(request_parser& parser, char* buffer, int size, bool keep_headers, int max_body) {
+        parser = request_parser{};
+        parser.buffer = buffer;
+        parser.size = size;
+        parser.keep_headers = keep_headers;
+        parser.max_body = max_body;
+        parser.started = millis();
+    }
 
-        http_request req;
-        parse_stage stage = parse_stage::method;
+    /*
+     * The parser has to see Content-Length itself to know where the request
+     * ends, whether or not headers are retained for handlers.
+     */
+    bool parse_header_line(const char* data, int len, http_request& req) {
+        int name_end = find_char(data, len, ':');
+        if (name_end == len)
+            return false;
 
-        int cursor = 0;
-        int header_i = 0;
-        while (cursor < len) {
-            char* data = buffer + cursor;
-            int remaining = len - cursor;
-
-            if (stage < parse_stage::headers) {
-                int space_i = find_whitespace(data, remaining);
-
-                char* holster;
-                parse_stage next;
-                switch (stage) {
-                    case parse_stage::method:
-                        holster = req.method;
-                        next = parse_stage::target;
-                        break;
-                    case parse_stage::target:
-                        holster = req.target;
-                        next = parse_stage::protocol;
-                        break;
-                    case parse_stage::protocol:
-                        holster = req.protocol;
-                        next = parse_stage::headers;
-                        break;
+        if (str_view{data, name_end}.iequals("Content-Length")) {
+            str_view value = trim(data + name_end + 1, len - name_end - 1);
+            long content_length = 0;
+            for (int i = 0; i < value.len; i++) {
+                if (value.data[i] < '0' || value.data[i] > '9')
+                    return false;
+                content_length = content_length * 10 + (value.data[i] - '0');
+                if (content_length > 0x7FFF)
+                    return false;
+            }
+            req.content_length = content_length;
+        }
+        else if (str_view{data, name_end}.iequals("Connection")) {
+            str_view value = trim(data + name_end + 1, len - name_end - 1);
+            if (value.iequals("close"))
+                req.keep_alive = false;
+            else if (value.iequals("keep-alive"))
+                req.keep_alive = true;
+        }
+        return true;
+    }
+
+    /*
+     * Advance the parser over whatever is buffered. Returns parse_incomplete
+     * when more bytes are needed; the caller reads more and calls again.
+     */
+    parse_status parse_request(request_parser& parser, http_request& req) {
+        while (parser.stage != parse_stage::complete) {
+            char* data = parser.buffer + parser.cursor;
+            int remaining = parser.len - parser.cursor;
+
+            if (parser.stage == parse_stage::method || parser.stage == parse_stage::target) {
+                int space_i = find_char(data, remaining, ' ');
+                if (find_endline(data, space_i) < space_i)
+                    return parse_error;
+                if (space_i == remaining)
+                    return parse_incomplete;
+
+                data[space_i] = '\0';
+                if (parser.stage == parse_stage::method)
+                    req.method_id = parse_method(str_view{data, space_i});
+
+                if (parser.stage == parse_stage::target) {
+                    int query_i = find_char(data, space_i, '?');
+                    if (query_i < space_i) {
+                        data[query_i] = '\0';
+                        req.query = str_view{data + query_i + 1, space_i - query_i - 1};
+                        space_i = query_i;
+                    }
                 }
 
-                cpy(holster, data, space_i);
-                cursor += space_i + 1;
-                stage = next;
+                str_view& holster = parser.stage == parse_stage::method ? req.method : req.target;
+                holster = str_view{data, space_i};
+                parser.cursor += space_i + 1;
+                parser.stage = parser.stage == parse_stage::method ? parse_stage::target : parse_stage::protocol;
             }
-            else if (stage == parse_stage::headers && header_i < ETH_MAX_HEADERS) {
-                // skip headers lol (read until we can an empty line)
+            else if (parser.stage == parse_stage::protocol || parser.stage == parse_stage::headers) {
                 int ll = find_endline(data, remaining);
-                int name_end = find_char(data, remaining, ':');
-
-                if (name_end + 2 < ll) {
-                #ifdef ETH_DISABLE_HEADERS
-                    http_header _header;
-                    http_header* header = &_header;
-                #else
-                    http_header* header = &req.headers[header_i];
-                #endif
-
-                    cpy(header->name, data, name_end);
-                    cpy(header->data, data + name_end + 2, ll - (name_end + 2));
-
-                    if (!strcmp(header->name, "Content-Length")) {
-                        char* end;
-                        req.content_length = strtol(header->data, &end, 10);
-                    }
 
-                #ifndef ETH_DISABLE_HEADERS
-                    req.num_headers++;
-                    header_i++;
-                #endif
+                // header lines are dropped once seen, so one that doesn't fit
+                // in the buffer can be skipped rather than failing the request
+                if (!parser.keep_headers && parser.stage == parse_stage::headers
+                    && (parser.skip_line || (ll == remaining && parser.len == parser.size))) {
+                    int drop = ll < remaining ? ll + 1 : remaining;
+                    memmove(data, data + drop, remaining - drop);
+                    parser.len -= drop;
+                    parser.skip_line = ll == remaining;
+                    if (parser.skip_line)
+                        return parse_incomplete;
+                    continue;
                 }
 
-                cursor += ll + 1;
+                if (ll == remaining)
+                    return parse_incomplete;
+
+                int line_len = ll > 0 && data[ll - 1] == '\r' ? ll - 1 : ll;
+                parser.cursor += ll + 1;
+
+                if (parser.stage == parse_stage::protocol) {
+                    data[line_len] = '\0';
+                    req.protocol = str_view{data, line_len};
+                    // persistent by default from HTTP/1.1 on
+                    req.keep_alive = !req.protocol.equals("HTTP/1.0");
+                    parser.stage = parse_stage::headers;
+                    parser.header_start = parser.cursor;
+                }
                 // between headers and body there will be a blank line.
-                if (ll < 2) {
-                    stage = parse_stage::body;
+                else if (line_len == 0) {
+                    if (parser.keep_headers)
+                        req.header_block = str_view{parser.buffer + parser.header_start, (int) (data - parser.buffer) - parser.header_start};
+                    parser.stage = req.content_length ? parse_stage::body : parse_stage::complete;
+                }
+                else if (!parse_header_line(data, line_len, req)) {
+                    return parse_error;
+                }
+                else if (!parser.keep_headers) {
+                    memmove(data, data + ll + 1, remaining - ll - 1);
+                    parser.len -= ll + 1;
+                    parser.cursor -= ll + 1;
                 }
             }
             else {
-                // body parsing
-            #ifndef ETH_DISABLE_BODY
-                memcpy(req.body, data, find_endline(data, remaining));
-            #endif
-                break;
+                int want = req.content_length - parser.body_received;
+                int n = remaining < want ? remaining : want;
+
+                if (!parser.max_body) {
+                    // nobody will look at it, drop it instead of buffering
+                    memmove(data, data + n, remaining - n);
+                    parser.len -= n;
+                } else {
+                    if (req.content_length > parser.max_body)
+                        return parse_error;
+                    parser.cursor += n;
+                }
+                parser.body_received += n;
+
+                if (parser.body_received < req.content_length)
+                    return parse_incomplete;
+
+                if (parser.max_body)
+                    req.body = str_view{parser.buffer + parser.cursor - req.content_length, req.content_length};
+                parser.stage = parse_stage::complete;
             }
         }
-        return req;
+
+        return parse_complete;
     }
 
-    const route_t* match_route(const http_request& req) {
-        for (int i = 0; i < route_table.num_routes; i++) {
-            const route_t* r = &route_table.routes[i];
+    void send_static(response_writer& writer, const static_response_t* fixed) {
+        static_response_t resp;
+        memcpy_P(&resp, fixed, sizeof(resp));
 
-            if (!strcmp(r->target, req.target))
-                return r;
-        }
-
-        return nullptr;
+        writer.begin_P(resp.head, resp.body_len);
+        writer.write_P(resp.body, resp.body_len);
+        writer.end();
     }
 
-    void send_response(EthernetClient& client, const http_response& resp) {
-        static char const* format =
-            "HTTP/1.1 %d %s\n"
-            "Content-Type: %s\n"
-            "Content-Length: %d\n"
-        #ifndef ETH_DISABLE_HEADERS
-            "%s"
-        #endif
-            "\n"
-            "%s";
+    using render_func_t = void (*)(Print&);
 
-    #ifndef ETH_DISABLE_HEADERS
-        static char const* header_format = "%s: %s\n";
-        static char header_buffer[2048];
-        static char scratch[512];
+    /*
+     * Answer from cache while generation hasn't changed: a 304 when the
+     * client's If-None-Match has the current ETag, else the stored body.
+     * Otherwise the body is rendered, sent and cached in one pass.
+     */
+    void send_cached(
+        const http_request& req,
+        response_writer& out,
+        ResponseCache::cache_t& cache,
+        uint32_t generation,
+        render_func_t render,
+        const char* content_type = "text/plain; charset=utf-8"
+    ) {
+        char etag[24];
+        if (ResponseCache::is_fresh(cache, generation)) {
+            ResponseCache::format_etag(cache, etag);
+            str_view if_none_match = find_header(req, "If-None-Match");
+            if (ResponseCache::etag_matches(if_none_match.data, if_none_match.len, etag)) {
+                out.begin_no_body(304, "Not Modified");
+                out.add_header("ETag", etag);
+                return;
+            }
 
-        int offset;
-        for (int i = 0; i < resp.num_headers; i++) {
-            sprintf(scratch, header_format, resp.headers[i].name, resp.headers[i].data);
-            strcpy(header_buffer + offset, scratch);
-            offset += strlen(scratch);
+            if (cache.complete) {
+                out.begin(200, "Success", content_type, cache.len);
+                out.add_header("ETag", etag);
+                out.write((const uint8_t*) cache.body, cache.len);
+                return;
+            }
         }
-    #endif
-
-    #ifndef ETH_DISABLE_BODY
-        const char* body = resp.body;
-    #else
-        const char* body = "";
-    #endif
 
-        sprintf(
-            buffer,
-            format,
-            resp.code,
-            resp.code_msg,
-            resp.content_type,
-            strlen(body),
-        #ifndef ETH_DISABLE_HEADERS
-            header_buffer,
-        #endif
-            body
-        );
+        ResponseCache::begin_render(cache, generation);
+        ResponseCache::format_etag(cache, etag);
+        out.begin(200, "Success", content_type);
+        out.add_header("ETag", etag);
 
-        int i = 0;
-        do {
-            client.write(buffer[i]);
-            i++;
-        } while (buffer[i] != '\0');
+        ResponseCache::tee_writer tee(out, cache);
+        render(tee);
     }
 
-    http_response default_not_found(const http_request& req) {
-        http_response resp;
-        resp.code = 404;
-        strcpy(resp.code_msg, "Not found");
-        return resp;
+    void print_label_value(Print& out, const char* value) {
+        for (; *value; value++) {
+            if (*value == '"' || *value == '\\')
+                out.write('\\');
+            out.write(*value);
+        }
     }
 
-    // user api
-
-    void setup(EthServerConfig& config) {
-        Serial.println("Server init");
+    /*
+     * SPI and the W5500, shared by every server. Call once before begin()
+     * on any of them.
+     */
+    void setup(const EthServerConfig& config) {
+        LOG("Server init");
         // SPI
     #ifdef ARDUINO_ARCH_RP2040
         bool ok = SPI.setRX(config.pin_rx);
@@ -306,7 +1073,7 @@ namespace EthHTTPServer {
             // true for hardware cs
             SPI.begin(true);
         } else {
-            Serial.println("Failed SPI");
+            LOG("Failed SPI");
         }
 
         Ethernet.init(config.pin_cs);
@@ -316,52 +1083,654 @@ namespace EthHTTPServer {
 
         // Ethernet interface
         if (config.ip) {
-            Ethernet.begin(config.mac, config.ip);
+            Ethernet.begin((uint8_t*) config.mac, config.ip);
         } else {
-            Ethernet.begin(config.mac);
+            Ethernet.begin((uint8_t*) config.mac);
         }
 
         if (Ethernet.hardwareStatus() == EthernetNoHardware) {
-            Serial.println("Ethernet not found.");
+            LOG("Ethernet not found.");
         } else {
-            Serial.println("Ethernet found.");
-            Serial.println(Ethernet.localIP());
+            IPAddress ip = Ethernet.localIP();
+            LOG("Ethernet found, %d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
         }
     }
 
-    void add_endpoint(const char* target, route_func_t func) {
-        #ifdef ARDUINO_ARCH_RP2040
-        assert(route_table.num_routes < MAX_ROUTES);
-        #endif
+    template<typename Config = default_config>
+    class Server {
+    public:
+        using response = basic_http_response<Config::max_response_len, Config::max_response_headers>;
+        using route_func_t = response (*)(const http_request&);
+        using route_handler = basic_route_handler<response>;
+        using static_route = basic_static_route<response, Config::max_route_target>;
 
-        route_t& new_route = route_table.routes[route_table.num_routes];
-        strcpy(new_route.target, target);
-        new_route.func = func;
-        route_table.num_routes++;
-    }
+        static_assert(Config::max_connections > 0, "a server needs at least one connection");
+        static_assert(Config::parse_buffer_size / Config::max_connections > 0, "parse_buffer_size is smaller than max_connections");
+        // chunk sizes are written as four hex digits
+        static_assert(Config::write_block_size <= 0xFFFF, "write_block_size doesn't fit a chunk head");
+        static_assert(Config::write_block_size > 16, "write_block_size is too small to frame a chunk");
 
-    void run() {
-        if (Ethernet.hardwareStatus() == EthernetNoHardware) {
-            Serial.println("Ethernet not found.");
-            return;
+        char buffer[Config::parse_buffer_size];
+
+    private:
+        enum : int {
+            conn_buffer_size = Config::parse_buffer_size / Config::max_connections,
+
+            // stats slots after the routes
+            stats_debug = Config::stats_max_routes,
+            stats_other,
+            stats_unmatched,
+            stats_slots
+        };
+
+        enum connection_state {
+            conn_free,
+            conn_reading,
+            conn_closing
+        };
+
+        /*
+         * One accepted socket. Each has its own slice of the parse buffer and
+         * its own parser, so run() can advance all of them a little at a time.
+         */
+        struct connection_t {
+            EthernetClient client;
+            connection_state state = conn_free;
+            request_parser parser;
+            http_request req;
+            storage_t<header_view, Config::max_headers> headers;
+            int requests = 0;
+            unsigned long last_activity = 0;
+        };
+
+        struct route_t {
+            route_handler handler{};
+            uint8_t captures;
+            char target[Config::max_route_target];
+        };
+
+        struct route_stats_t {
+            uint32_t requests;
+            uint32_t responses[5];  // by status class, 1xx to 5xx
+            uint32_t bytes_in;
+            uint32_t bytes_out;
+            histogram_t phases[num_phases];
+        };
+
+        struct server_stats_t {
+            route_stats_t routes[stats_slots];
+            histogram_t accept;
+            uint32_t connections;
+            uint32_t rejected;
+            response_stats_t current;
+        };
+
+        EthernetServer server{Config::port};
+        connection_t connections[Config::max_connections];
+        char out_buffer[Config::write_block_size];
+
+        int num_routes = 0;
+        storage_t<route_t, Config::max_routes> routes;
+        storage_t<route_handler, Config::not_found_handler ? 1 : 0> not_found;
+        const static_route* static_routes = nullptr;
+        int num_static_routes = 0;
+        // captures of the request being answered
+        storage_t<str_view, Config::max_path_params> path_params;
+
+        storage_t<server_stats_t, Config::instrumentation ? 1 : 0> stats;
+        bool no_hardware = false;
+
+        response_writer make_writer(EthernetClient& client, bool keep_alive, bool chunked_ok = true) {
+            return response_writer(
+                client, out_buffer, sizeof(out_buffer), keep_alive, chunked_ok,
+                stats.data() ? &stats.data()->current : nullptr
+            );
         }
 
-        EthernetClient client = server.available();
-        if (client) {
-            digitalWrite(LED_BUILTIN, HIGH);
+        response_writer make_writer(EthernetClient& client, const http_request& req) {
+            return make_writer(client, req.keep_alive, !req.protocol.equals("HTTP/1.0"));
+        }
+
+        static response default_not_found(const http_request&) {
+            response resp{};
+            resp.code = 404;
+            strcpy(resp.code_msg, "Not found");
+            return resp;
+        }
+
+        static response default_bad_request() {
+            response resp{};
+            resp.code = 400;
+            strcpy(resp.code_msg, "Bad Request");
+            return resp;
+        }
+
+        /*
+         * One pass over the table for an exact target. A route for the
+         * request's own method wins over an HTTP_ANY one wherever they are.
+         */
+        bool match_static_route(const http_request& req, route_handler& out, int& slot) {
+            uint32_t key = route_key(req.target);
+            int found = -1;
+
+            for (int i = 0; i < num_static_routes; i++) {
+                const static_route* r = &static_routes[i];
+
+                uint32_t stored_key;
+                memcpy_P(&stored_key, &r->key, sizeof(stored_key));
+                if (stored_key != key || pgm_read_byte(&r->captures))
+                    continue;
+
+                http_method method = (http_method) pgm_read_byte(&r->method);
+                if (method != req.method_id && (method != HTTP_ANY || found >= 0))
+                    continue;
+                if (strcmp_P(req.target.data, r->target))
+                    continue;
+
+                found = i;
+                if (method == req.method_id)
+                    break;
+            }
+
+            if (found < 0)
+                return false;
+
+            memcpy_P(&out, &static_routes[found].handler, sizeof(out));
+            slot = found;
+            return true;
+        }
+
+        bool capture(http_request& req, const char* pattern, bool in_flash) {
+            int num_params;
+            if (!match_pattern(pattern, in_flash, req.target, path_params.data(), Config::max_path_params, num_params))
+                return false;
+
+            req.route_pattern = pattern;
+            req.pattern_in_flash = in_flash;
+            req.path_params = path_params.data();
+            req.num_path_params = num_params;
+            return true;
+        }
 
-            http_request req = parse_request(client);
-            const route_t* r = match_route(req);
+        bool match_static_pattern(http_request& req, route_handler& out, int& slot) {
+            for (int i = 0; i < num_static_routes; i++) {
+                const static_route* r = &static_routes[i];
 
-            if (r) {
-                send_response(client, r->func(req));
-            } else if (route_table.not_found.func) {
-                send_response(client, route_table.not_found.func(req));
+                http_method method = (http_method) pgm_read_byte(&r->method);
+                if (!pgm_read_byte(&r->captures) || (method != req.method_id && method != HTTP_ANY))
+                    continue;
+                if (!capture(req, r->target, true))
+                    continue;
+
+                memcpy_P(&out, &r->handler, sizeof(out));
+                slot = i;
+                return true;
+            }
+
+            return false;
+        }
+
+        void send_response(EthernetClient& client, const response& resp, bool keep_alive = false) {
+            response_writer writer = make_writer(client, keep_alive);
+            writer.begin(resp.code, resp.code_msg, resp.content_type, strlen(resp.body));
+            const http_header* headers = resp.headers.data();
+            for (int i = 0; headers && i < resp.num_headers; i++) {
+                writer.add_header(headers[i].name, headers[i].data);
+            }
+            writer.print(resp.body);
+            writer.end();
+        }
+
+        // true when the body ends at the close, see body_ends_at_close
+        bool send_route(EthernetClient& client, const route_handler& route, http_request& req) {
+            if (route.fixed) {
+                response_writer writer = make_writer(client, req);
+                send_static(writer, route.fixed);
+            } else if (route.stream) {
+                response_writer writer = make_writer(client, req);
+                route.stream(req, writer);
+                writer.end();
+                req.keep_alive = writer.keeps_alive();
+                return writer.body_ends_at_close();
             } else {
-                send_response(client, default_not_found(req));
+                send_response(client, route.func(req), req.keep_alive);
+            }
+            return false;
+        }
+
+        void record_request(int slot, int bytes_in, uint32_t parse_us, uint32_t respond_us) {
+            server_stats_t* s = stats.data();
+            if (!s)
+                return;
+
+            const response_stats_t& current = s->current;
+            route_stats_t& route = s->routes[slot];
+            route.requests++;
+            int status_class = current.status / 100;
+            if (status_class >= 1 && status_class <= 5)
+                route.responses[status_class - 1]++;
+            route.bytes_in += bytes_in;
+            route.bytes_out += current.bytes_out;
+
+            observe(route.phases[phase_parse], parse_us);
+            observe(route.phases[phase_handler], respond_us > current.write_us ? respond_us - current.write_us : 0);
+            observe(route.phases[phase_write], current.write_us);
+        }
+
+        void print_route_label(Print& out, int slot) {
+            char target[Config::max_route_target];
+            const char* label = "";
+            // the reserved slots first, they're past stats_max_routes however
+            // many routes there are
+            if (slot == stats_debug) {
+                label = Config::debug_metrics_path;
+            } else if (slot == stats_other) {
+                label = "(other)";
+            } else if (slot == stats_unmatched) {
+                label = "(unmatched)";
+            } else if (slot < num_static_routes) {
+                memcpy_P(target, static_routes[slot].target, sizeof(target));
+                target[sizeof(target) - 1] = '\0';
+                label = target;
+            } else if (const route_t* added = routes.data()) {
+                label = added[slot - num_static_routes].target;
             }
 
+            out.print("route=\"");
+            print_label_value(out, label);
+            out.write('"');
+        }
+
+        void print_labels(Print& out, int slot, int phase) {
+            static const char* const names[] = {"parse", "handler", "write"};
+            print_route_label(out, slot);
+            out.print(",phase=\"");
+            out.print(names[phase]);
+            out.write('"');
+        }
+
+        // phase < 0 for a series without labels, here and in print_histogram
+        void print_series(Print& out, const char* name, const char* suffix, int slot, int phase) {
+            out.print(name);
+            out.print(suffix);
+            if (phase >= 0) {
+                out.write('{');
+                print_labels(out, slot, phase);
+                out.write('}');
+            }
+            out.write(' ');
+        }
+
+        void print_histogram(Print& out, const char* name, const histogram_t& hist, int slot, int phase) {
+            uint32_t cumulative = 0;
+            for (int i = 0; i < num_latency_buckets; i++) {
+                cumulative += hist.counts[i];
+                out.print(name);
+                out.print("_bucket{");
+                if (phase >= 0) {
+                    print_labels(out, slot, phase);
+                    out.write(',');
+                }
+                out.print("le=\"");
+                if (i < num_latency_buckets - 1)
+                    out.print(latency_bounds_us[i] / 1e6, 4);
+                else
+                    out.print("+Inf");
+                out.print("\"} ");
+                out.print(cumulative);
+                out.write('\n');
+            }
+
+            print_series(out, name, "_sum", slot, phase);
+            out.print(hist.sum_us / 1e6, 6);
+            out.write('\n');
+
+            print_series(out, name, "_count", slot, phase);
+            out.print(cumulative);
+            out.write('\n');
+        }
+
+        void print_route_counter(Print& out, const char* name, int slot, uint32_t value) {
+            out.print(name);
+            out.print('{');
+            print_route_label(out, slot);
+            out.print("} ");
+            out.print(value);
+            out.write('\n');
+        }
+
+        void send_debug_metrics(response_writer& out) {
+            if (!stats.data())
+                return;
+
+            const server_stats_t& s = *stats.data();
+            out.begin(200, "Success", "text/plain; version=0.0.4; charset=utf-8");
+
+            out.print("# TYPE eth_http_connections_total counter\neth_http_connections_total ");
+            out.print(s.connections);
+            out.write('\n');
+            out.print("# TYPE eth_http_rejected_connections_total counter\neth_http_rejected_connections_total ");
+            out.print(s.rejected);
+            out.write('\n');
+            out.print("# TYPE eth_http_accept_seconds histogram\n");
+            print_histogram(out, "eth_http_accept_seconds", s.accept, 0, -1);
+
+            out.print("# TYPE eth_http_requests_total counter\n");
+            for (int slot = 0; slot < stats_slots; slot++) {
+                if (s.routes[slot].requests)
+                    print_route_counter(out, "eth_http_requests_total", slot, s.routes[slot].requests);
+            }
+
+            out.print("# TYPE eth_http_responses_total counter\n");
+            for (int slot = 0; slot < stats_slots; slot++) {
+                for (int i = 0; i < 5; i++) {
+                    if (!s.routes[slot].responses[i])
+                        continue;
+                    out.print("eth_http_responses_total{");
+                    print_route_label(out, slot);
+                    out.printf(",code=\"%dxx\"} ", i + 1);
+                    out.print(s.routes[slot].responses[i]);
+                    out.write('\n');
+                }
+            }
+
+            out.print("# TYPE eth_http_request_bytes_total counter\n");
+            for (int slot = 0; slot < stats_slots; slot++) {
+                if (s.routes[slot].requests)
+                    print_route_counter(out, "eth_http_request_bytes_total", slot, s.routes[slot].bytes_in);
+            }
+
+            out.print("# TYPE eth_http_response_bytes_total counter\n");
+            for (int slot = 0; slot < stats_slots; slot++) {
+                if (s.routes[slot].requests)
+                    print_route_counter(out, "eth_http_response_bytes_total", slot, s.routes[slot].bytes_out);
+            }
+
+            out.print("# TYPE eth_http_phase_seconds histogram\n");
+            for (int slot = 0; slot < stats_slots; slot++) {
+                if (!s.routes[slot].requests)
+                    continue;
+                for (int phase = 0; phase < num_phases; phase++)
+                    print_histogram(out, "eth_http_phase_seconds", s.routes[slot].phases[phase], slot, phase);
+            }
+        }
+
+        void new_request(connection_t& conn) {
+            conn.req = http_request{};
+            conn.req.headers = conn.headers.data();
+            conn.req.max_headers = Config::max_headers;
+            conn.req.header_whitelist = Config::header_whitelist;
+            conn.req.header_whitelist_len = Config::header_whitelist_len;
+        }
+
+        void open_connection(connection_t& conn, EthernetClient& client) {
+            int i = &conn - connections;
+            conn.client = client;
+            conn.client.setConnectionTimeout(Config::close_timeout_ms);
+            conn.state = conn_reading;
+            new_request(conn);
+            conn.requests = 0;
+            conn.last_activity = millis();
+            reset_parser(conn.parser, buffer + i * conn_buffer_size, conn_buffer_size,
+                         Config::max_headers > 0, Config::max_request_body);
+        }
+
+        /*
+         * Get ready for the next request on a persistent connection. Whatever
+         * was received past the end of the last request (a pipelined request)
+         * moves to the front of the buffer.
+         */
+        void next_request(connection_t& conn) {
+            request_parser& parser = conn.parser;
+            int leftover = parser.len - parser.cursor;
+            memmove(parser.buffer, parser.buffer + parser.cursor, leftover);
+
+            reset_parser(parser, parser.buffer, parser.size, parser.keep_headers, parser.max_body);
+            parser.len = leftover;
+            new_request(conn);
+            conn.last_activity = millis();
+        }
+
+        void close_connection(connection_t& conn) {
+            conn.client.stop();
+            conn.client = EthernetClient();
+            conn.state = conn_free;
+        }
+
+        void accept_connections() {
+            while (true) {
+                unsigned long accept_started = Config::instrumentation ? micros() : 0;
+                EthernetClient client = server.accept();
+                if (!client)
+                    return;
+
+                connection_t* free_conn = nullptr;
+                for (int i = 0; i < Config::max_connections && !free_conn; i++) {
+                    if (connections[i].state == conn_free)
+                        free_conn = &connections[i];
+                }
+
+                if (free_conn) {
+                    open_connection(*free_conn, client);
+                } else {
+                    static const char busy[] =
+                        "HTTP/1.1 503 Service Unavailable\r\n"
+                        "Content-Length: 0\r\n"
+                        "Connection: close\r\n\r\n";
+                    client.write((const uint8_t*) busy, sizeof(busy) - 1);
+                    client.setConnectionTimeout(Config::close_timeout_ms);
+                    client.stop();
+                }
+
+                if (server_stats_t* s = stats.data()) {
+                    s->connections++;
+                    if (!free_conn)
+                        s->rejected++;
+                    observe(s->accept, micros() - accept_started);
+                }
+            }
+        }
+
+        // true when the body ends at the close, see body_ends_at_close
+        bool respond(connection_t& conn, parse_status status) {
+            digitalWrite(LED_BUILTIN, HIGH);
+            unsigned long started = 0;
+            if (server_stats_t* s = stats.data()) {
+                started = micros();
+                s->current = response_stats_t{};
+            }
+
+            route_handler route;
+            const route_handler* not_found_route = not_found.data();
+            int slot;
+            // routes past stats_max_routes are counted together, so a route
+            // never lands on one of the reserved slots
+            int stats_slot = stats_unmatched;
+            bool ends_at_close = false;
+            if (status == parse_error) {
+                send_response(conn.client, default_bad_request());
+            } else if (match_route(conn.req, route, slot)) {
+                stats_slot = slot < Config::stats_max_routes ? slot : (int) stats_other;
+                ends_at_close = send_route(conn.client, route, conn.req);
+            } else if (Config::instrumentation && conn.req.target.equals(Config::debug_metrics_path)) {
+                stats_slot = stats_debug;
+                response_writer writer = make_writer(conn.client, conn.req);
+                send_debug_metrics(writer);
+                writer.end();
+                conn.req.keep_alive = writer.keeps_alive();
+                ends_at_close = writer.body_ends_at_close();
+            } else if (not_found_route && !not_found_route->empty()) {
+                ends_at_close = send_route(conn.client, *not_found_route, conn.req);
+            } else {
+                send_response(conn.client, default_not_found(conn.req), conn.req.keep_alive);
+            }
+
+            if (Config::instrumentation)
+                record_request(stats_slot, conn.parser.cursor, conn.parser.parse_us, micros() - started);
             digitalWrite(LED_BUILTIN, LOW);
+            return ends_at_close;
         }
-    }
+
+        /*
+         * Advance one connection by whatever its socket has ready, answering
+         * every complete request in order. Responses are written in one go,
+         * the W5500 buffers a typical response per socket. Longer ones hold
+         * up run() while the client drains them, which is why the history
+         * endpoints page theirs. Once a connection is done it
+         * waits for the client to hang up, so stop() doesn't have to block on
+         * the close handshake, unless the body only ends when we close.
+         */
+        void service_connection(connection_t& conn) {
+            request_parser& parser = conn.parser;
+
+            if (conn.state == conn_closing) {
+                // drain anything the client still sends
+                while (conn.client.available() > 0) conn.client.read();
+                if (!conn.client.connected() || millis() - conn.last_activity > Config::request_timeout_ms)
+                    close_connection(conn);
+                return;
+            }
+
+            int n = read_available(conn.client, parser.buffer + parser.len, parser.size - parser.len);
+            // the request timeout runs from its first byte, not from the last response
+            if (n > 0 && parser.len == 0)
+                parser.started = millis();
+            parser.len += n;
+
+            while (true) {
+                unsigned long parse_started = Config::instrumentation ? micros() : 0;
+                parse_status status = parse_request(parser, conn.req);
+                if (Config::instrumentation)
+                    parser.parse_us += micros() - parse_started;
+
+                // the request head has to fit in the buffer since the request points into it
+                if (status == parse_incomplete && parser.len == parser.size)
+                    status = parse_error;
+
+                if (status == parse_incomplete) {
+                    bool idle = parser.len == 0;
+                    bool timed_out = idle
+                        ? millis() - conn.last_activity > Config::keepalive_timeout_ms
+                        : millis() - parser.started > Config::request_timeout_ms;
+
+                    // timed out or hung up mid-request, nothing to answer
+                    if (timed_out || !conn.client.connected())
+                        close_connection(conn);
+                    return;
+                }
+
+                conn.requests++;
+                if (status == parse_error || conn.requests >= Config::max_keepalive_requests)
+                    conn.req.keep_alive = false;
+
+                // the client only sees the end of a close-delimited body once
+                // we hang up, so there's no waiting for it to go first
+                if (respond(conn, status)) {
+                    close_connection(conn);
+                    return;
+                }
+
+                if (!conn.req.keep_alive) {
+                    conn.state = conn_closing;
+                    conn.last_activity = millis();
+                    return;
+                }
+                next_request(conn);
+            }
+        }
+
+    public:
+        /*
+         * Start listening, after setup().
+         */
+        void begin() {
+            server.begin();
+        }
+
+        void add_route(const char* target, const route_handler& handler) {
+            static_assert(Config::max_routes > 0, "max_routes is 0, use set_routes()");
+            #ifdef ARDUINO_ARCH_RP2040
+            assert(num_routes < Config::max_routes);
+            #endif
+            if (num_routes >= Config::max_routes || strlen(target) >= sizeof(routes[0].target))
+                return;
+
+            route_t& new_route = routes[num_routes];
+            strcpy(new_route.target, target);
+            new_route.captures = count_captures(target);
+            new_route.handler = handler;
+            num_routes++;
+        }
+
+        void add_endpoint(const char* target, route_func_t func) {
+            add_route(target, func);
+        }
+
+        void add_endpoint(const char* target, stream_func_t func) {
+            add_route(target, func);
+        }
+
+        void add_endpoint(const char* target, const static_response_t* fixed) {
+            add_route(target, fixed);
+        }
+
+        template<int N>
+        void set_routes(const static_route (&table)[N]) {
+            static_routes = table;
+            num_static_routes = N;
+        }
+
+        /*
+         * Answers requests no route matches, instead of a plain 404.
+         */
+        void set_not_found(const route_handler& handler) {
+            static_assert(Config::not_found_handler, "not_found_handler is off in this config");
+            not_found[0] = handler;
+        }
+
+        /*
+         * Exact static routes come first by hash, then static patterns, then
+         * added routes in the order they were added. slot numbers the matched
+         * route (static then added). A pattern's captures are left in req.
+         */
+        bool match_route(http_request& req, route_handler& out, int& slot) {
+            if (match_static_route(req, out, slot) || match_static_pattern(req, out, slot))
+                return true;
+
+            for (int i = 0; i < num_routes; i++) {
+                const route_t* r = routes.data() + i;
+
+                if (r->captures ? capture(req, r->target, false) : req.target.equals(r->target)) {
+                    out = r->handler;
+                    slot = num_static_routes + i;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        bool match_route(http_request& req, route_handler& out) {
+            int slot;
+            return match_route(req, out, slot);
+        }
+
+        void run() {
+            if (Ethernet.hardwareStatus() == EthernetNoHardware) {
+                // once, rather than on every loop
+                if (!no_hardware)
+                    LOG("Ethernet not found.");
+                no_hardware = true;
+                return;
+            }
+            no_hardware = false;
+
+            accept_connections();
+
+            for (int i = 0; i < Config::max_connections; i++) {
+                if (connections[i].state != conn_free)
+                    service_connection(connections[i]);
+            }
+        }
+    };
 }
@@ -0,0 +1,153 @@
+/*
+ * Minimal Arduino core for building the utils headers on a Linux host.
+ * Only what the headers in utils/ use is provided. Time comes from the
+ * host's monotonic clock so timeouts behave like they do on a board.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <assert.h>
+#include <time.h>
+
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define LED_BUILTIN 13
+
+// no separate flash address space on the host
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+typedef const char* PGM_P;
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+#define strlen_P strlen
+#define strncpy_P strncpy
+#define vsnprintf_P vsnprintf
+#define pgm_read_byte(addr) (*(const uint8_t*) (addr))
+
+unsigned long micros() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) (ts.tv_sec * 1000000ull + ts.tv_nsec / 1000);
+}
+
+unsigned long millis() {
+    return micros() / 1000;
+}
+
+void delay(unsigned long) {}
+void yield() {}
+void pinMode(int, int) {}
+void digitalWrite(int, int) {}
+
+struct IPAddress {
+    uint8_t octets[4];
+
+    IPAddress(uint32_t addr = 0) {
+        memcpy(octets, &addr, sizeof(octets));
+    }
+
+    uint8_t operator[](int i) const {
+        return octets[i];
+    }
+};
+
+class Print {
+public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t c) = 0;
+
+    virtual size_t write(const uint8_t* data, size_t len) {
+        size_t i = 0;
+        while (i < len && write(data[i])) i++;
+        return i;
+    }
+
+    size_t write(const char* s) {
+        return write((const uint8_t*) s, strlen(s));
+    }
+
+    size_t write(const char* data, size_t len) {
+        return write((const uint8_t*) data, len);
+    }
+
+    size_t print(const char* s) {
+        return write(s);
+    }
+
+    size_t print(char c) {
+        return write((uint8_t) c);
+    }
+
+    size_t print(long v) {
+        char buf[24];
+        return write(buf, snprintf(buf, sizeof(buf), "%ld", v));
+    }
+
+    size_t print(unsigned long v) {
+        char buf[24];
+        return write(buf, snprintf(buf, sizeof(buf), "%lu", v));
+    }
+
+    size_t print(int v) {
+        return print((long) v);
+    }
+
+    size_t print(unsigned int v) {
+        return print((unsigned long) v);
+    }
+
+    size_t print(double v, int digits = 2) {
+        char buf[48];
+        return write(buf, snprintf(buf, sizeof(buf), "%.*f", digits, v));
+    }
+
+    size_t print(const IPAddress& addr) {
+        char buf[16];
+        return write(buf, snprintf(
+            buf, sizeof(buf), "%d.%d.%d.%d",
+            addr.octets[0], addr.octets[1], addr.octets[2], addr.octets[3]
+        ));
+    }
+
+    template<typename T>
+    size_t println(T v) {
+        return print(v) + write("\r\n");
+    }
+
+    size_t println() {
+        return write("\r\n");
+    }
+};
+
+// Serial output is discarded, it would only skew measurements
+class HardwareSerial : public Print {
+public:
+    void begin(unsigned long) {}
+
+    int availableForWrite() {
+        return 64;
+    }
+
+    void flush() {}
+
+    size_t write(uint8_t) override {
+        return 1;
+    }
+
+    using Print::write;
+};
+
+HardwareSerial Serial;
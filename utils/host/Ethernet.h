@@ -0,0 +1,152 @@
+/*
+ * In-memory stand-in for the Arduino Ethernet library. A test queues
+ * mock_socket connections on mock_accept_queue; EthernetServer::accept()
+ * hands them out and EthernetClient reads and writes them like a W5500
+ * socket would.
+ */
+#pragma once
+
+#include "Arduino.h"
+
+#define MAX_SOCK_NUM 8
+
+enum EthernetHardwareStatus {
+    EthernetNoHardware,
+    EthernetW5500
+};
+
+struct mock_socket {
+    // bytes the client sends, exposed at most `segment` bytes per
+    // available() call to imitate data arriving in pieces
+    const uint8_t* in = nullptr;
+    size_t in_len = 0;
+    size_t in_pos = 0;
+    size_t segment = (size_t) -1;
+
+    // what the server wrote, kept up to out_cap bytes
+    uint8_t* out = nullptr;
+    size_t out_cap = 0;
+    size_t out_len = 0;
+    unsigned long writes = 0;
+
+    bool peer_closed = false;
+    bool stopped = false;
+};
+
+static const int mock_queue_size = 16;
+mock_socket* mock_accept_queue[mock_queue_size];
+int mock_accept_count = 0;
+
+bool mock_connect(mock_socket* sock) {
+    if (mock_accept_count == mock_queue_size)
+        return false;
+    mock_accept_queue[mock_accept_count++] = sock;
+    return true;
+}
+
+class EthernetClient : public Print {
+    mock_socket* sock;
+
+public:
+    EthernetClient(mock_socket* sock = nullptr) : sock(sock) {}
+
+    int available() {
+        if (!sock || sock->stopped)
+            return 0;
+        size_t remaining = sock->in_len - sock->in_pos;
+        return (int) (remaining < sock->segment ? remaining : sock->segment);
+    }
+
+    int read() {
+        if (available() <= 0)
+            return -1;
+        return sock->in[sock->in_pos++];
+    }
+
+    int read(uint8_t* buf, size_t size) {
+        int n = available();
+        if (n <= 0)
+            return -1;
+        if ((size_t) n > size)
+            n = size;
+        memcpy(buf, sock->in + sock->in_pos, n);
+        sock->in_pos += n;
+        return n;
+    }
+
+    size_t write(uint8_t c) override {
+        return write(&c, 1);
+    }
+
+    size_t write(const uint8_t* data, size_t len) override {
+        if (!sock || sock->stopped)
+            return 0;
+        size_t space = sock->out_cap - sock->out_len;
+        size_t n = len < space ? len : space;
+        if (n)
+            memcpy(sock->out + sock->out_len, data, n);
+        sock->out_len += n;
+        sock->writes++;
+        return len;
+    }
+
+    using Print::write;
+
+    // like the real library, a peer that closed still counts as connected
+    // while unread data remains
+    uint8_t connected() {
+        if (!sock || sock->stopped)
+            return 0;
+        return !sock->peer_closed || available() > 0;
+    }
+
+    void setConnectionTimeout(uint16_t) {}
+
+    void stop() {
+        if (sock)
+            sock->stopped = true;
+        sock = nullptr;
+    }
+
+    explicit operator bool() {
+        return sock != nullptr;
+    }
+};
+
+class EthernetServer {
+public:
+    EthernetServer(uint16_t) {}
+
+    void begin() {}
+
+    EthernetClient accept() {
+        if (mock_accept_count == 0)
+            return EthernetClient();
+
+        mock_socket* sock = mock_accept_queue[0];
+        mock_accept_count--;
+        memmove(mock_accept_queue, mock_accept_queue + 1, mock_accept_count * sizeof(mock_socket*));
+        return EthernetClient(sock);
+    }
+};
+
+class EthernetClass {
+public:
+    void init(uint8_t) {}
+
+    int begin(uint8_t*) {
+        return 1;
+    }
+
+    void begin(uint8_t*, IPAddress) {}
+
+    EthernetHardwareStatus hardwareStatus() {
+        return EthernetW5500;
+    }
+
+    IPAddress localIP() {
+        return IPAddress(0x0100007f);
+    }
+};
+
+EthernetClass Ethernet;
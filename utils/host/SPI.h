@@ -0,0 +1,7 @@
+#pragma once
+
+struct SPIClass {
+    void begin() {}
+};
+
+SPIClass SPI;
@@ -0,0 +1,32 @@
+/*
+ * Server configurations for the host harnesses, after the firmwares' own.
+ * Pick one with -DHOST_BOARD_DT_REMOTE or -DHOST_BOARD_GARDEN, the default
+ * config otherwise. The harnesses add their routes at run time, so these
+ * keep max_routes.
+ */
+#pragma once
+
+#include "eth_server.h"
+
+struct dt_remote_config : EthHTTPServer::default_config {
+    static constexpr int max_connections = 2;
+    static constexpr int parse_buffer_size = 128;
+    static constexpr int max_headers = 0;
+    static constexpr int max_request_body = 0;
+    static constexpr int max_response_len = 0;
+    static constexpr int max_response_headers = 0;
+};
+
+struct garden_config : EthHTTPServer::default_config {
+    static constexpr bool instrumentation = true;
+};
+
+#if defined(HOST_BOARD_DT_REMOTE)
+using host_config = dt_remote_config;
+#elif defined(HOST_BOARD_GARDEN)
+using host_config = garden_config;
+#else
+using host_config = EthHTTPServer::default_config;
+#endif
+
+using host_server_t = EthHTTPServer::Server<host_config>;
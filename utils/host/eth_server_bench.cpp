@@ -0,0 +1,219 @@
+/*
+ * Request throughput of eth_server.h on the host, against mock sockets.
+ *
+ *   g++ -O2 -std=gnu++11 -I utils/host -I utils utils/host/eth_server_bench.cpp -o eth_server_bench
+ *
+ * Bench a board's configuration from board_configs.h by adding its flag,
+ * e.g. -DHOST_BOARD_DT_REMOTE.
+ */
+#include "board_configs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#endif
+
+static host_server_t server;
+static uint8_t response_sink[16384];
+
+static const char scrape_request[] =
+    "GET /metrics HTTP/1.1\r\n"
+    "Host: 10.253.0.140\r\n"
+    "User-Agent: Prometheus/2.45.0\r\n"
+    "Accept: application/openmetrics-text;version=1.0.0,application/openmetrics-text;version=0.0.1;q=0.75,"
+    "text/plain;version=0.0.4;q=0.5,*/*;q=0.1\r\n"
+    "Accept-Encoding: gzip\r\n"
+    "X-Prometheus-Scrape-Timeout-Seconds: 10\r\n"
+    "\r\n";
+
+static const char control_request[] =
+    "GET /power/on HTTP/1.1\r\n"
+    "Host: 10.253.0.132\r\n"
+    "User-Agent: python-requests/2.31.0\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static const char pattern_request[] =
+    "GET /pin/power/on HTTP/1.1\r\n"
+    "Host: 10.253.0.132\r\n"
+    "User-Agent: python-requests/2.31.0\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Accept: */*\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static const char health_request[] =
+    "GET / HTTP/1.1\r\n"
+    "Host: 10.253.0.132\r\n"
+    "User-Agent: kube-probe/1.28\r\n"
+    "Accept: */*\r\n"
+    "Connection: close\r\n"
+    "\r\n";
+
+static const char post_request[] =
+    "POST /power/on HTTP/1.1\r\n"
+    "Host: 10.253.0.132\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 16\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "{\"state\": true}\n";
+
+void handle_metrics(const EthHTTPServer::http_request&, EthHTTPServer::response_writer& out) {
+    static const char* const names[] = {
+        "air_humidity_percent", "air_temperature_celsius", "bucket_humidity_percent",
+        "bucket_temperature_celsius", "solution_ph", "solution_temperature_celsius",
+    };
+
+    out.begin(200, "Success");
+    for (int i = 0; i < 6; i++) {
+        out.printf(
+            "# HELP garden_%s Sensor value.\n"
+            "# TYPE garden_%s gauge\n"
+            "garden_%s %f\n",
+            names[i], names[i], names[i], 20.0 + i * 1.25
+        );
+    }
+}
+
+void handle_power(const EthHTTPServer::http_request&, EthHTTPServer::response_writer& out) {
+    out.print("{\"power\": true}\n");
+}
+
+ETH_STATIC_RESPONSE(health_response, "200 Success", "text/plain; charset=utf-8", "Jetson remote control.\n");
+
+struct bench_case {
+    const char* name;
+    const char* request;
+    size_t segment;
+    int pipelined;
+};
+
+// one connection's slice of the parse buffer
+static const size_t conn_buffer_size = host_config::parse_buffer_size / host_config::max_connections;
+
+static uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t now_cycles() {
+#ifdef HAVE_CYCLES
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+/*
+ * One connection carrying `pipelined` copies of the request, driven
+ * through run() until the server closes it.
+ */
+static size_t serve_once(const uint8_t* input, size_t len, size_t segment) {
+    mock_socket sock;
+    sock.in = input;
+    sock.in_len = len;
+    sock.segment = segment;
+    sock.out = response_sink;
+    sock.out_cap = sizeof(response_sink);
+    sock.peer_closed = true;
+
+    mock_connect(&sock);
+    while (!sock.stopped) server.run();
+    return sock.out_len;
+}
+
+static void run_case(const bench_case& c, int iterations) {
+    static uint8_t input[8192];
+    size_t request_len = strlen(c.request);
+    size_t len = 0;
+    for (int i = 0; i < c.pipelined && len + request_len <= sizeof(input); i++) {
+        memcpy(input + len, c.request, request_len);
+        len += request_len;
+    }
+
+    size_t out_len = serve_once(input, len, c.segment);
+
+    uint64_t start_ns = now_ns();
+    uint64_t start_cycles = now_cycles();
+    for (int i = 0; i < iterations; i++) serve_once(input, len, c.segment);
+    uint64_t cycles = now_cycles() - start_cycles;
+    uint64_t ns = now_ns() - start_ns;
+
+    double requests = (double) iterations * c.pipelined;
+    printf(
+        "%-22s %10.0f req/s %9.1f %s/byte %7zu bytes out\n",
+        c.name,
+        requests / (ns / 1e9),
+        (double) cycles / (iterations * (double) len),
+    #ifdef HAVE_CYCLES
+        "cycles",
+    #else
+        "ns",
+    #endif
+        out_len / c.pipelined
+    );
+}
+
+/*
+ * The parser alone, over a request already sitting in the buffer.
+ */
+static void run_parse_only(const char* name, const char* request, int iterations) {
+    size_t len = strlen(request);
+    EthHTTPServer::request_parser parser;
+    EthHTTPServer::http_request req;
+
+    uint64_t start_cycles = now_cycles();
+    for (int i = 0; i < iterations; i++) {
+        memcpy(server.buffer, request, len);
+        EthHTTPServer::reset_parser(parser, server.buffer, conn_buffer_size,
+                                    host_config::max_headers > 0, host_config::max_request_body);
+        parser.len = len;
+        req = EthHTTPServer::http_request{};
+        EthHTTPServer::parse_request(parser, req);
+    }
+    uint64_t cycles = now_cycles() - start_cycles;
+
+    printf(
+        "%-22s %9.1f %s/byte\n",
+        name,
+        (double) cycles / (iterations * (double) len),
+    #ifdef HAVE_CYCLES
+        "cycles"
+    #else
+        "ns"
+    #endif
+    );
+}
+
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+
+    server.begin();
+    server.add_endpoint("/metrics", &handle_metrics);
+    server.add_endpoint("/power/on", &handle_power);
+    server.add_endpoint("/", &health_response);
+    server.add_endpoint("/pin/{name}/{state}", &handle_power);
+
+    const bench_case cases[] = {
+        {"scrape", scrape_request, (size_t) -1, 1},
+        {"scrape, 64B segments", scrape_request, 64, 1},
+        {"control", control_request, (size_t) -1, 1},
+        {"control, 8B segments", control_request, 8, 1},
+        {"control, pipelined x8", control_request, (size_t) -1, 8},
+        {"control, pattern route", pattern_request, (size_t) -1, 1},
+        {"post with body", post_request, (size_t) -1, 1},
+        {"static response", health_request, (size_t) -1, 1},
+    };
+
+    for (const bench_case& c : cases) run_case(c, iterations);
+
+    if (strlen(scrape_request) <= conn_buffer_size)
+        run_parse_only("parse only, scrape", scrape_request, iterations * 10);
+    if (strlen(control_request) <= conn_buffer_size)
+        run_parse_only("parse only, control", control_request, iterations * 10);
+    return 0;
+}
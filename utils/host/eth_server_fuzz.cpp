@@ -0,0 +1,176 @@
+/*
+ * Fuzz harness for the eth_server.h request path: parsing, routing and
+ * responding, with the input split into segments of varying size.
+ *
+ * libFuzzer:
+ *   clang++ -g -O1 -fsanitize=fuzzer,address -std=gnu++11 -I utils/host -I utils \
+ *       utils/host/eth_server_fuzz.cpp -o eth_server_fuzz
+ * AFL, or replaying inputs by hand (files as arguments, else stdin):
+ *   afl-g++ -g -O1 -fsanitize=address -DETH_FUZZ_STANDALONE -std=gnu++11 -I utils/host -I utils \
+ *       utils/host/eth_server_fuzz.cpp -o eth_server_fuzz
+ *
+ * Board configurations are fuzzed by picking one from board_configs.h, e.g.
+ * -DHOST_BOARD_DT_REMOTE or -DHOST_BOARD_GARDEN.
+ *
+ * Input layout: the first byte picks the segment size the socket hands out
+ * per read. The second picks the shape of the echoed response: its low six
+ * bits the Content-Type length, the top bit a server with a small output
+ * block, so headers and chunk heads land on block edges. The third byte is
+ * how much padding the echo adds to its body. The rest is what the client
+ * sends.
+ */
+#include "board_configs.h"
+
+// the board's config with the smallest block that still frames a chunk
+struct small_block_config : host_config {
+    static constexpr int write_block_size = 17;
+};
+
+using small_server_t = EthHTTPServer::Server<small_block_config>;
+
+static host_server_t server;
+static small_server_t small_server;
+
+static uint8_t response_sink[8192];
+
+// the parse buffer of the server taking this input
+static const char* parse_buffer;
+static size_t parse_buffer_size;
+
+static char content_type[64];
+static int body_padding;
+
+static void check_view(const EthHTTPServer::str_view& view) {
+    if (!view.len)
+        return;
+
+    // every view has to stay inside the parse buffer
+    assert(view.data >= parse_buffer);
+    assert(view.data + view.len <= parse_buffer + parse_buffer_size);
+
+    volatile char sink = 0;
+    for (int i = 0; i < view.len; i++) sink ^= view.data[i];
+}
+
+void handle_echo(const EthHTTPServer::http_request& req, EthHTTPServer::response_writer& out) {
+    check_view(req.method);
+    check_view(req.target);
+    check_view(req.query);
+    check_view(req.protocol);
+    check_view(req.body);
+    check_view(EthHTTPServer::find_query_param(req, "since"));
+    check_view(EthHTTPServer::find_header(req, "Host"));
+    check_view(EthHTTPServer::find_header(req, "If-None-Match"));
+
+    out.begin(200, "Success", content_type);
+    out.printf("%s %s %d\n", req.method.data, req.target.data, req.content_length);
+    out.write((const uint8_t*) req.body.data, req.body.len);
+    for (int i = 0; i < body_padding; i++)
+        out.write('.');
+}
+
+host_server_t::response handle_plain(const EthHTTPServer::http_request& req) {
+    check_view(req.target);
+    return host_server_t::response{};
+}
+
+void handle_pin(const EthHTTPServer::http_request& req, EthHTTPServer::response_writer& out) {
+    check_view(EthHTTPServer::find_path_param(req, "name"));
+    check_view(EthHTTPServer::find_path_param(req, "n"));
+    check_view(EthHTTPServer::find_path_param(req, "missing"));
+
+    EthHTTPServer::str_view rest = req.query, name, value;
+    while (EthHTTPServer::next_query_param(rest, name, value)) {
+        check_view(name);
+        check_view(value);
+    }
+    out.print("pin\n");
+}
+
+ETH_STATIC_RESPONSE(static_response, "200 Success", "text/plain", "static\n");
+
+static bool setup_done = false;
+
+template<typename Server>
+void setup_server(Server& s) {
+    s.begin();
+    s.add_endpoint("/", &handle_echo);
+    s.add_endpoint("/plain", &handle_plain);
+    s.add_endpoint("/static", &static_response);
+    s.add_endpoint("/pin/{name}/{n:uint}", &handle_pin);
+}
+
+template<typename Server>
+void run_input(Server& s, mock_socket& sock) {
+    parse_buffer = s.buffer;
+    parse_buffer_size = sizeof(s.buffer);
+    mock_connect(&sock);
+
+    // feed the input while the client is still connected, then hang up
+    for (int i = 0; sock.in_pos < sock.in_len && !sock.stopped && i < 100000; i++) {
+        s.run();
+    }
+    sock.peer_closed = true;
+    for (int i = 0; !sock.stopped && i < 100000; i++) {
+        s.run();
+    }
+    assert(sock.stopped);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    static const char long_type[] = "text/plain; version=0.0.4; charset=utf-8; q=0123456789abcdefghijk";
+    static_assert(sizeof(long_type) > sizeof(content_type), "long_type covers every length");
+
+    if (!setup_done) {
+        setup_server(server);
+        setup_server(small_server);
+        setup_done = true;
+    }
+
+    if (size < 3)
+        return 0;
+
+    int type_len = data[1] & 0x3F;
+    memcpy(content_type, long_type, type_len);
+    content_type[type_len] = '\0';
+    body_padding = data[2];
+
+    mock_socket sock;
+    sock.segment = data[0] % 64 + 1;
+    sock.in = data + 3;
+    sock.in_len = size - 3;
+    sock.out = response_sink;
+    sock.out_cap = sizeof(response_sink);
+
+    if (data[1] & 0x80)
+        run_input(small_server, sock);
+    else
+        run_input(server, sock);
+    return 0;
+}
+
+#ifdef ETH_FUZZ_STANDALONE
+static void run_file(FILE* f) {
+    static uint8_t input[1 << 16];
+    size_t size = fread(input, 1, sizeof(input), f);
+    LLVMFuzzerTestOneInput(input, size);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        run_file(stdin);
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        FILE* f = fopen(argv[i], "rb");
+        if (!f) {
+            perror(argv[i]);
+            return 1;
+        }
+        run_file(f);
+        fclose(f);
+    }
+    return 0;
+}
+#endif
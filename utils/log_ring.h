@@ -0,0 +1,188 @@
+/*
+ * Deferred logging. A log line is formatted into a RAM ring with its time
+ * and returns straight away. drain() copies lines out to the serial port
+ * from loop() only as far as the UART has room, so a log call never
+ * blocks on the baud rate:
+ *
+ *   LOG("Sent metrics");
+ *   LOG("pH %d.%02d", whole, hundredths);
+ *   ...
+ *   Log::drain();                // at the end of loop()
+ *   Log::render_tail(out);       // e.g. from a /debug/log handler
+ *
+ * The ring keeps the newest lines, oldest are overwritten. Lines that are
+ * overwritten before being drained are reported as dropped.
+ */
+#include <Arduino.h>
+
+// must be a power of two
+#ifndef LOG_RING_SIZE
+#define LOG_RING_SIZE 1024
+#endif
+
+// longest line kept, longer ones are cut
+#ifndef LOG_MAX_LINE
+#define LOG_MAX_LINE 96
+#endif
+
+#ifndef LOG_SERIAL
+#define LOG_SERIAL Serial
+#endif
+
+#define LOG(format, ...) Log::printf_P(PSTR(format), ##__VA_ARGS__)
+
+namespace Log {
+    // length byte and millis() ahead of each line's text
+    const int header_size = 5;
+    // "[seconds.millis] " ahead of a drained line
+    const int max_prefix = 16;
+
+    static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE must be a power of two");
+    static_assert(LOG_MAX_LINE <= 255 && LOG_MAX_LINE + header_size <= LOG_RING_SIZE, "LOG_MAX_LINE doesn't fit");
+
+    struct ring_t {
+        uint8_t data[LOG_RING_SIZE];
+        // positions count up forever and wrap through the mask
+        uint32_t head = 0;     // next write
+        uint32_t tail = 0;     // oldest line kept
+        uint32_t drained = 0;  // next line to drain
+        uint32_t dropped = 0;  // lines lost before they were drained
+
+        // the line being drained, with its prefix
+        char line[max_prefix + LOG_MAX_LINE + 1];
+        int line_len = 0;
+        int line_pos = 0;
+    };
+
+    static ring_t ring;
+
+    uint8_t byte_at(uint32_t pos) {
+        return ring.data[pos & (LOG_RING_SIZE - 1)];
+    }
+
+    void copy_out(uint32_t pos, void* dest, int len) {
+        uint8_t* out = (uint8_t*) dest;
+        for (int i = 0; i < len; i++)
+            out[i] = byte_at(pos + i);
+    }
+
+    void copy_in(uint32_t pos, const void* src, int len) {
+        const uint8_t* in = (const uint8_t*) src;
+        for (int i = 0; i < len; i++)
+            ring.data[(pos + i) & (LOG_RING_SIZE - 1)] = in[i];
+    }
+
+    uint32_t next_line(uint32_t pos) {
+        return pos + header_size + byte_at(pos);
+    }
+
+    void write(const char* text, int len) {
+        if (len > LOG_MAX_LINE)
+            len = LOG_MAX_LINE;
+
+        uint32_t end = ring.head + header_size + len;
+        while (end - ring.tail > LOG_RING_SIZE) {
+            if (ring.tail == ring.drained) {
+                ring.drained = next_line(ring.drained);
+                ring.dropped++;
+            }
+            ring.tail = next_line(ring.tail);
+        }
+
+        uint8_t header[header_size];
+        uint32_t now = millis();
+        header[0] = len;
+        for (int i = 0; i < 4; i++)
+            header[1 + i] = now >> (8 * i);
+
+        copy_in(ring.head, header, header_size);
+        copy_in(ring.head + header_size, text, len);
+        ring.head = end;
+    }
+
+    void vprintf_P(PGM_P format, va_list args) {
+        char text[LOG_MAX_LINE + 1];
+        int n = vsnprintf_P(text, sizeof(text), format, args);
+        if (n < 0)
+            return;
+
+        write(text, n < (int) sizeof(text) ? n : sizeof(text) - 1);
+    }
+
+    void printf_P(PGM_P format, ...) {
+        va_list args;
+        va_start(args, format);
+        vprintf_P(format, args);
+        va_end(args);
+    }
+
+    /*
+     * Format the line at pos into dest as "[seconds.millis] text\n".
+     */
+    int format_line(uint32_t pos, char* dest) {
+        int len = byte_at(pos);
+        uint32_t time = 0;
+        for (int i = 0; i < 4; i++)
+            time |= (uint32_t) byte_at(pos + 1 + i) << (8 * i);
+
+        int n = snprintf(dest, max_prefix + 1, "[%lu.%03lu] ", (unsigned long) (time / 1000), (unsigned long) (time % 1000));
+        if (n > max_prefix)
+            n = max_prefix;
+
+        copy_out(pos + header_size, dest + n, len);
+        dest[n + len] = '\n';
+        return n + len + 1;
+    }
+
+    /*
+     * Copy what the serial port can take without blocking.
+     */
+    void drain() {
+        int room = LOG_SERIAL.availableForWrite();
+
+        while (room > 0) {
+            if (ring.line_pos == ring.line_len) {
+                ring.line_pos = ring.line_len = 0;
+
+                if (ring.dropped) {
+                    ring.line_len = snprintf(ring.line, sizeof(ring.line), "[log] %lu lines dropped\n", (unsigned long) ring.dropped);
+                    ring.dropped = 0;
+                } else if (ring.drained != ring.head) {
+                    ring.line_len = format_line(ring.drained, ring.line);
+                    ring.drained = next_line(ring.drained);
+                } else {
+                    return;
+                }
+            }
+
+            int n = ring.line_len - ring.line_pos;
+            if (n > room)
+                n = room;
+            LOG_SERIAL.write((const uint8_t*) ring.line + ring.line_pos, n);
+            ring.line_pos += n;
+            room -= n;
+        }
+    }
+
+    /*
+     * Drain everything, blocking, e.g. before deep sleep.
+     */
+    void flush() {
+        while (ring.line_pos != ring.line_len || ring.dropped || ring.drained != ring.head) {
+            drain();
+            yield();
+        }
+        LOG_SERIAL.flush();
+    }
+
+    /*
+     * Every line still in the ring, oldest first.
+     */
+    void render_tail(Print& out) {
+        char line[max_prefix + LOG_MAX_LINE + 1];
+        for (uint32_t pos = ring.tail; pos != ring.head; pos = next_line(pos)) {
+            int n = format_line(pos, line);
+            out.write((const uint8_t*) line, n);
+        }
+    }
+}
@@ -0,0 +1,212 @@
+/*
+ * Measures how long loop() iterations take and which calls inside them
+ * block the longest.
+ *
+ *   void loop() {
+ *       LoopProfiler::tick();
+ *       { LOOP_PROFILE("http"); server.run(); }
+ *       { LOOP_PROFILE("sampler"); Sampler::run(sampler); }
+ *   }
+ *   ...
+ *   LoopProfiler::render(out);   // Prometheus text, e.g. from /debug/loop
+ *
+ * Iteration times go into a histogram with four buckets per power of two,
+ * so the p99 is reported within 25%. Max and p99 cover the last complete
+ * window of LOOP_PROFILE_WINDOW_MS, so one slow start doesn't stick forever.
+ */
+#include <Arduino.h>
+
+#ifndef LOOP_PROFILE_WINDOW_MS
+#define LOOP_PROFILE_WINDOW_MS 10000
+#endif
+
+// sites listed by render(), the slowest first
+#ifndef LOOP_PROFILE_MAX_SITES
+#define LOOP_PROFILE_MAX_SITES 16
+#endif
+
+#define LOOP_PROFILE_CONCAT2(a, b) a##b
+#define LOOP_PROFILE_CONCAT(a, b) LOOP_PROFILE_CONCAT2(a, b)
+
+// Times the rest of the enclosing block as one call site
+#define LOOP_PROFILE(name)                                                          \
+    static LoopProfiler::site_t LOOP_PROFILE_CONCAT(loop_site_, __LINE__)(PSTR(name)); \
+    LoopProfiler::scope_t LOOP_PROFILE_CONCAT(loop_scope_, __LINE__)(LOOP_PROFILE_CONCAT(loop_site_, __LINE__))
+
+namespace LoopProfiler {
+    // up to 2^26 us (about a minute), four buckets per power of two
+    const int sub_buckets = 4;
+    const int num_buckets = 25 * sub_buckets;
+
+    struct window_t {
+        uint32_t buckets[num_buckets];
+        uint32_t iterations;
+        uint32_t max_us;
+    };
+
+    struct site_t {
+        PGM_P name;
+        uint32_t calls = 0;
+        uint64_t total_us = 0;
+        uint32_t max_us = 0;       // in the current window
+        uint32_t last_max_us = 0;  // in the last complete window
+        site_t* next;
+
+        site_t(PGM_P name);
+    };
+
+    struct profiler_t {
+        window_t current;
+        window_t last;
+        unsigned long window_started = 0;
+        unsigned long last_tick = 0;
+        bool ticked = false;
+        uint32_t iterations = 0;
+        site_t* sites = nullptr;
+    };
+
+    static profiler_t profiler;
+
+    site_t::site_t(PGM_P name) : name(name), next(profiler.sites) {
+        profiler.sites = this;
+    }
+
+    /*
+     * Records the enclosing block's time against a site when it goes out of
+     * scope.
+     */
+    class scope_t {
+        site_t& site;
+        unsigned long started;
+
+    public:
+        scope_t(site_t& site) : site(site), started(micros()) {}
+
+        ~scope_t() {
+            uint32_t us = micros() - started;
+            site.calls++;
+            site.total_us += us;
+            if (us > site.max_us)
+                site.max_us = us;
+        }
+    };
+
+    int bucket_for(uint32_t us) {
+        if (us < sub_buckets)
+            return us;
+
+        int msb = 31 - __builtin_clz(us);
+        int sub = (us >> (msb - 2)) & (sub_buckets - 1);
+        int bucket = (msb - 1) * sub_buckets + sub;
+        return bucket < num_buckets ? bucket : num_buckets - 1;
+    }
+
+    // smallest time above everything in bucket
+    uint32_t bucket_limit(int bucket) {
+        if (bucket < sub_buckets)
+            return bucket + 1;
+
+        int msb = bucket / sub_buckets + 1;
+        int sub = bucket % sub_buckets;
+        return ((uint32_t) (sub_buckets + sub + 1)) << (msb - 2);
+    }
+
+    void end_window() {
+        profiler.last = profiler.current;
+        memset(&profiler.current, 0, sizeof(profiler.current));
+        for (site_t* site = profiler.sites; site; site = site->next) {
+            site->last_max_us = site->max_us;
+            site->max_us = 0;
+        }
+    }
+
+    /*
+     * Call once at the top of loop(), each call closes the iteration that
+     * started at the last one.
+     */
+    void tick() {
+        unsigned long now = micros();
+        if (profiler.ticked) {
+            uint32_t us = now - profiler.last_tick;
+            profiler.current.buckets[bucket_for(us)]++;
+            profiler.current.iterations++;
+            if (us > profiler.current.max_us)
+                profiler.current.max_us = us;
+            profiler.iterations++;
+        } else {
+            profiler.window_started = millis();
+            profiler.ticked = true;
+        }
+        profiler.last_tick = now;
+
+        if (millis() - profiler.window_started >= LOOP_PROFILE_WINDOW_MS) {
+            end_window();
+            profiler.window_started = millis();
+        }
+    }
+
+    uint32_t percentile_us(const window_t& window, uint32_t permille) {
+        uint32_t rank = ((uint64_t) window.iterations * permille + 999) / 1000;
+        uint32_t seen = 0;
+        for (int i = 0; i < num_buckets; i++) {
+            seen += window.buckets[i];
+            if (seen >= rank && seen)
+                return bucket_limit(i) < window.max_us ? bucket_limit(i) : window.max_us;
+        }
+        return window.max_us;
+    }
+
+    void print_seconds(Print& out, uint64_t us) {
+        out.print((unsigned long) (us / 1000000));
+        char frac[10];
+        snprintf(frac, sizeof(frac), ".%06lu\n", (unsigned long) (us % 1000000));
+        out.print(frac);
+    }
+
+    void print_site(Print& out, const char* metric, const site_t& site, uint64_t us) {
+        char name[32];
+        strncpy_P(name, site.name, sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+
+        out.print(metric);
+        out.print("{site=\"");
+        out.print(name);
+        out.print("\"} ");
+        print_seconds(out, us);
+    }
+
+    /*
+     * Sites are listed by their worst call in the last window, slowest
+     * first.
+     */
+    void render(Print& out) {
+        const window_t& window = profiler.last;
+
+        out.print("# TYPE loop_iterations_total counter\nloop_iterations_total ");
+        out.print((unsigned long) profiler.iterations);
+        out.print("\n# TYPE loop_max_seconds gauge\nloop_max_seconds ");
+        print_seconds(out, window.max_us);
+        out.print("# TYPE loop_p99_seconds gauge\nloop_p99_seconds ");
+        print_seconds(out, percentile_us(window, 990));
+
+        site_t* sorted[LOOP_PROFILE_MAX_SITES];
+        int num_sorted = 0;
+        for (site_t* site = profiler.sites; site; site = site->next) {
+            int i = num_sorted < LOOP_PROFILE_MAX_SITES ? num_sorted++ : LOOP_PROFILE_MAX_SITES;
+            for (; i > 0 && sorted[i - 1]->last_max_us < site->last_max_us; i--) {
+                if (i < LOOP_PROFILE_MAX_SITES)
+                    sorted[i] = sorted[i - 1];
+            }
+            if (i < LOOP_PROFILE_MAX_SITES)
+                sorted[i] = site;
+        }
+
+        out.print("# TYPE loop_site_max_seconds gauge\n");
+        for (int i = 0; i < num_sorted; i++)
+            print_site(out, "loop_site_max_seconds", *sorted[i], sorted[i]->last_max_us);
+
+        out.print("# TYPE loop_site_seconds_total counter\n");
+        for (int i = 0; i < num_sorted; i++)
+            print_site(out, "loop_site_seconds_total", *sorted[i], sorted[i]->total_us);
+    }
+}
@@ -0,0 +1,339 @@
+/*
+ * Fixed size history of periodic metric snapshots, so a collector that
+ * missed scrapes can backfill them.
+ *
+ * Records are packed into a ring of blocks. Each value is stored in fixed
+ * point as a zigzag varint delta from the record before, so a slowly moving
+ * sensor costs a byte or two per sample. Deltas restart from zero at the
+ * start of every block, which makes each block decodable on its own and
+ * lets the oldest one be dropped whole when the ring is full.
+ *
+ * Timestamps are seconds since boot plus epoch_offset, which stays 0 until
+ * the firmware learns the wall clock time and calls set_wall_clock.
+ *
+ *   #include "prom_metrics.h"    // for PROM_NAME
+ *   HISTORY_CHANNEL(history, "air_humidity_percent", &reading.humidity);
+ *   ...
+ *   History::run(history);           // in loop()
+ *   uint32_t until = History::page_end(history, since);
+ *   History::render(history, since, out, until);
+ *
+ * A page covers HISTORY_PAGE_BLOCKS blocks, so one response stays a few
+ * KB however much the ring holds. until is where the next page starts.
+ */
+#include <Arduino.h>
+
+#ifndef HISTORY_BLOCK_SIZE
+#define HISTORY_BLOCK_SIZE 256
+#endif
+
+#ifndef HISTORY_BLOCKS
+#define HISTORY_BLOCKS 16
+#endif
+
+#ifndef HISTORY_MAX_CHANNELS
+#define HISTORY_MAX_CHANNELS 8
+#endif
+
+#ifndef HISTORY_INTERVAL_MS
+#define HISTORY_INTERVAL_MS 30000
+#endif
+
+#ifndef HISTORY_PAGE_BLOCKS
+#define HISTORY_PAGE_BLOCKS 2
+#endif
+
+#define HISTORY_CHANNEL(hist, name, value) \
+    History::add_channel(hist, PSTR(PROM_NAME(name)), value)
+
+namespace History {
+    // values are kept to two decimals
+    const int32_t scale = 100;
+    // time delta, channel mask and a 32 bit value per channel, as varints
+    const int max_record_size = 5 + 5 + 5 * HISTORY_MAX_CHANNELS;
+
+    static_assert(HISTORY_MAX_CHANNELS <= 32, "the channel mask is 32 bits");
+    static_assert(max_record_size <= HISTORY_BLOCK_SIZE, "HISTORY_BLOCK_SIZE can't fit a record");
+
+    struct channel_t {
+        PGM_P name;
+        const float* value;
+    };
+
+    struct block_t {
+        uint32_t start;  // time of the first record
+        uint16_t used;
+        uint8_t data[HISTORY_BLOCK_SIZE];
+    };
+
+    struct history_t {
+        int num_channels = 0;
+        channel_t channels[HISTORY_MAX_CHANNELS];
+
+        block_t blocks[HISTORY_BLOCKS];
+        int head = 0;        // block being written
+        int num_blocks = 0;  // blocks holding records
+
+        uint32_t epoch_offset = 0;
+        // millis() wraps every 49.7 days, see now_seconds
+        uint32_t last_millis = 0;
+        uint32_t millis_wraps = 0;
+        unsigned long last_record = 0;
+        bool has_recorded = false;
+
+        // the previous record in the head block, deltas are taken from it
+        uint32_t prev_time = 0;
+        int32_t prev[HISTORY_MAX_CHANNELS];
+    };
+
+    void add_channel(history_t& hist, PGM_P name, const float* value) {
+        if (hist.num_channels >= HISTORY_MAX_CHANNELS)
+            return;
+
+        hist.channels[hist.num_channels++] = channel_t{name, value};
+    }
+
+    int put_varint(uint8_t* out, uint32_t v) {
+        int n = 0;
+        while (v >= 0x80) {
+            out[n++] = (v & 0x7F) | 0x80;
+            v >>= 7;
+        }
+        out[n++] = v;
+        return n;
+    }
+
+    /*
+     * Returns bytes consumed, 0 when the varint runs past the end.
+     */
+    int get_varint(const uint8_t* data, int len, uint32_t& v) {
+        v = 0;
+        for (int i = 0; i < len && i < 5; i++) {
+            v |= (uint32_t) (data[i] & 0x7F) << (7 * i);
+            if (!(data[i] & 0x80))
+                return i + 1;
+        }
+        return 0;
+    }
+
+    uint32_t zigzag(int32_t v) {
+        return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+    }
+
+    int32_t unzigzag(uint32_t v) {
+        return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+    }
+
+    /*
+     * Seconds since boot, carried on past millis() wrapping. run() reads
+     * the clock on every call, so no wrap goes unseen.
+     */
+    uint32_t now_seconds(history_t& hist) {
+        uint32_t ms = millis();
+        if (ms < hist.last_millis)
+            hist.millis_wraps++;
+        hist.last_millis = ms;
+
+        return (((uint64_t) hist.millis_wraps << 32) | ms) / 1000;
+    }
+
+    /*
+     * Anchor timestamps to the wall clock, given the current Unix time.
+     * Records are kept relative to boot, so ones already taken move too.
+     */
+    void set_wall_clock(history_t& hist, uint32_t unix_time) {
+        hist.epoch_offset = unix_time - now_seconds(hist);
+    }
+
+    block_t& start_block(history_t& hist, uint32_t time) {
+        if (hist.num_blocks) {
+            hist.head = (hist.head + 1) % HISTORY_BLOCKS;
+        }
+        if (hist.num_blocks < HISTORY_BLOCKS)
+            hist.num_blocks++;
+
+        block_t& block = hist.blocks[hist.head];
+        block.start = time;
+        block.used = 0;
+        hist.prev_time = 0;
+        memset(hist.prev, 0, sizeof(hist.prev));
+        return block;
+    }
+
+    /*
+     * Append the channels' current values, NaNs are left out of the record.
+     */
+    void record(history_t& hist) {
+        uint32_t time = now_seconds(hist);
+        block_t* block = &hist.blocks[hist.head];
+        if (!hist.num_blocks || block->used + max_record_size > HISTORY_BLOCK_SIZE)
+            block = &start_block(hist, time);
+
+        uint8_t* out = block->data + block->used;
+        int32_t values[HISTORY_MAX_CHANNELS];
+        uint32_t mask = 0;
+
+        for (int i = 0; i < hist.num_channels; i++) {
+            float value = *hist.channels[i].value;
+            if (isnan(value) || isinf(value))
+                continue;
+
+            values[i] = lroundf(value * scale);
+            mask |= 1UL << i;
+        }
+
+        int n = put_varint(out, time - hist.prev_time);
+        n += put_varint(out + n, mask);
+        for (int i = 0; i < hist.num_channels; i++) {
+            if (!(mask & (1UL << i)))
+                continue;
+
+            n += put_varint(out + n, zigzag(values[i] - hist.prev[i]));
+            hist.prev[i] = values[i];
+        }
+
+        hist.prev_time = time;
+        block->used += n;
+    }
+
+    /*
+     * Record every HISTORY_INTERVAL_MS.
+     */
+    void run(history_t& hist) {
+        // keeps the wrap count current between records
+        now_seconds(hist);
+
+        unsigned long now = millis();
+        if (hist.has_recorded && now - hist.last_record < HISTORY_INTERVAL_MS)
+            return;
+
+        record(hist);
+        hist.last_record = now;
+        hist.has_recorded = true;
+    }
+
+    void print_fixed(Print& out, int32_t v) {
+        uint32_t mag = v < 0 ? -(uint32_t) v : v;
+        if (v < 0)
+            out.write('-');
+
+        out.print((unsigned long) (mag / scale));
+        out.write('.');
+        uint32_t frac = mag % scale;
+        if (frac < 10)
+            out.write('0');
+        out.print((unsigned long) frac);
+    }
+
+    /*
+     * Write one channel's samples in [since, until) in a block, as
+     * OpenMetrics lines.
+     */
+    void render_block(const history_t& hist, const block_t& block, int channel, uint32_t since, uint32_t until, Print& out) {
+        uint32_t time = 0;
+        int32_t prev[HISTORY_MAX_CHANNELS] = {};
+        int pos = 0;
+
+        while (pos < block.used) {
+            uint32_t delta, mask;
+            int n = get_varint(block.data + pos, block.used - pos, delta);
+            int m = n ? get_varint(block.data + pos + n, block.used - pos - n, mask) : 0;
+            if (!m)
+                return;
+
+            pos += n + m;
+            time += delta;
+
+            for (int i = 0; i < hist.num_channels; i++) {
+                if (!(mask & (1UL << i)))
+                    continue;
+
+                uint32_t v;
+                n = get_varint(block.data + pos, block.used - pos, v);
+                if (!n)
+                    return;
+
+                pos += n;
+                prev[i] += unzigzag(v);
+            }
+
+            // records are in time order
+            if (time >= until)
+                return;
+            if (time < since || !(mask & (1UL << channel)))
+                continue;
+
+            Prom::write_P(out, hist.channels[channel].name);
+            out.write(' ');
+            print_fixed(out, prev[channel]);
+            out.write(' ');
+            out.print((unsigned long) (time + hist.epoch_offset));
+            out.write('\n');
+        }
+    }
+
+    int oldest_block(const history_t& hist) {
+        return (hist.head - hist.num_blocks + 1 + HISTORY_BLOCKS) % HISTORY_BLOCKS;
+    }
+
+    // since in the output time base to the stored one
+    uint32_t stored_time(const history_t& hist, uint32_t t) {
+        return t > hist.epoch_offset ? t - hist.epoch_offset : 0;
+    }
+
+    /*
+     * Index from the oldest of the first block holding samples from since
+     * (stored time base) on. The block is entirely before since if the next
+     * one starts before it.
+     */
+    int first_block(const history_t& hist, uint32_t since) {
+        int oldest = oldest_block(hist);
+        int i = 0;
+        while (i + 1 < hist.num_blocks && hist.blocks[(oldest + i + 1) % HISTORY_BLOCKS].start < since)
+            i++;
+        return i;
+    }
+
+    /*
+     * Where a page starting at since ends, in the output time base: the
+     * start of the block HISTORY_PAGE_BLOCKS past the page's first, or 0
+     * when the rest of the ring fits in the page. Always past since, so
+     * following the pages can't loop on blocks that start together.
+     */
+    uint32_t page_end(const history_t& hist, uint32_t since) {
+        since = stored_time(hist, since);
+        int oldest = oldest_block(hist);
+        int end = first_block(hist, since) + HISTORY_PAGE_BLOCKS;
+        while (end < hist.num_blocks && hist.blocks[(oldest + end) % HISTORY_BLOCKS].start <= since)
+            end++;
+
+        if (end >= hist.num_blocks)
+            return 0;
+
+        return hist.blocks[(oldest + end) % HISTORY_BLOCKS].start + hist.epoch_offset;
+    }
+
+    /*
+     * Stream every sample in [since, until) (in the same time base as the
+     * output, until 0 for no end) as OpenMetrics, one channel at a time
+     * since OpenMetrics wants each metric's samples together.
+     */
+    void render(const history_t& hist, uint32_t since, Print& out, uint32_t until = 0) {
+        since = stored_time(hist, since);
+        until = until ? stored_time(hist, until) : UINT32_MAX;
+        int oldest = oldest_block(hist);
+        int first = first_block(hist, since);
+
+        for (int channel = 0; channel < hist.num_channels; channel++) {
+            for (int i = first; i < hist.num_blocks; i++) {
+                const block_t& block = hist.blocks[(oldest + i) % HISTORY_BLOCKS];
+                if (block.start >= until)
+                    break;
+
+                render_block(hist, block, channel, since, until, out);
+            }
+        }
+
+        out.print("# EOF\n");
+    }
+}
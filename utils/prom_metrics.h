@@ -0,0 +1,279 @@
+/*
+ * Prometheus text exposition from a fixed registry of metrics.
+ *
+ * Each metric's constant text (HELP/TYPE/UNIT lines and the sample name
+ * with its labels) is assembled by the preprocessor into one flash string
+ * when it's registered, so a scrape only copies that text out and formats
+ * the values. Register from a function (setup) since PSTR needs one:
+ *
+ *   #define PROM_NAMESPACE "garden"
+ *   PROM_GAUGE(metrics, "air_humidity_percent", "Air humidity.", "%", &reading.humidity);
+ *   ...
+ *   Prom::render(metrics, out);
+ *
+ * The same registry can also be read as a compact binary snapshot, see
+ * encode_binary().
+ */
+#include <Arduino.h>
+
+#ifndef PROM_NAMESPACE
+#error "Define PROM_NAMESPACE before including prom_metrics.h"
+#endif
+
+#ifndef PROM_MAX_METRICS
+#define PROM_MAX_METRICS 32
+#endif
+
+// decimal places printed for float values
+#ifndef PROM_VALUE_DIGITS
+#define PROM_VALUE_DIGITS 3
+#endif
+
+// bumped when the binary layout changes
+#define PROM_BINARY_VERSION 1
+
+#define PROM_NAME(name) PROM_NAMESPACE "_" name
+
+#define PROM_GAUGE(reg, name, help, unit, value)                   \
+    Prom::add(reg, PSTR(                                            \
+        "# HELP " PROM_NAME(name) " " help "\n"                     \
+        "# TYPE " PROM_NAME(name) " gauge\n"                        \
+        "# UNIT " PROM_NAME(name) " " unit "\n"                     \
+        PROM_NAME(name) " "), value)
+
+// First series of a labelled gauge family, add the rest with PROM_SERIES
+#define PROM_LABELED_GAUGE(reg, name, labels, help, unit, value)   \
+    Prom::add(reg, PSTR(                                            \
+        "# HELP " PROM_NAME(name) " " help "\n"                     \
+        "# TYPE " PROM_NAME(name) " gauge\n"                        \
+        "# UNIT " PROM_NAME(name) " " unit "\n"                     \
+        PROM_NAME(name) "{" labels "} "), value)
+
+#define PROM_COUNTER(reg, name, help, value)                       \
+    Prom::add(reg, PSTR(                                            \
+        "# HELP " PROM_NAME(name) " " help "\n"                     \
+        "# TYPE " PROM_NAME(name) " counter\n"                      \
+        PROM_NAME(name) " "), value)
+
+// First series of a labelled counter family, add the rest with PROM_SERIES
+#define PROM_LABELED_COUNTER(reg, name, labels, help, value)       \
+    Prom::add(reg, PSTR(                                            \
+        "# HELP " PROM_NAME(name) " " help "\n"                     \
+        "# TYPE " PROM_NAME(name) " counter\n"                      \
+        PROM_NAME(name) "{" labels "} "), value)
+
+#define PROM_SERIES(reg, name, labels, value)                      \
+    Prom::add(reg, PSTR(PROM_NAME(name) "{" labels "} "), value)
+
+namespace Prom {
+    enum value_kind : uint8_t {
+        float_value,
+        uint_value
+    };
+
+    struct metric_t {
+        PGM_P text;
+        const void* value;
+        value_kind kind;
+    };
+
+    struct registry_t {
+        int num_metrics = 0;
+        metric_t metrics[PROM_MAX_METRICS];
+        // schema_id() of the metrics above, hashed on first use
+        mutable uint32_t schema = 0;
+        mutable bool schema_known = false;
+    };
+
+    void add(registry_t& reg, PGM_P text, const void* value, value_kind kind) {
+        if (reg.num_metrics >= PROM_MAX_METRICS)
+            return;
+
+        reg.metrics[reg.num_metrics++] = metric_t{text, value, kind};
+        reg.schema_known = false;
+    }
+
+    void add(registry_t& reg, PGM_P text, const float* value) {
+        add(reg, text, value, float_value);
+    }
+
+    void add(registry_t& reg, PGM_P text, const uint32_t* value) {
+        add(reg, text, value, uint_value);
+    }
+
+    /*
+     * Copy a flash string to the output a block at a time.
+     */
+    void write_P(Print& out, PGM_P text, size_t len) {
+        char block[64];
+
+        for (size_t offset = 0; offset < len; offset += sizeof(block)) {
+            size_t n = len - offset < sizeof(block) ? len - offset : sizeof(block);
+            memcpy_P(block, text + offset, n);
+            out.write((const uint8_t*) block, n);
+        }
+    }
+
+    void write_P(Print& out, PGM_P text) {
+        write_P(out, text, strlen_P(text));
+    }
+
+    // where the sample's name starts, after the HELP/TYPE/UNIT lines
+    size_t series_offset(PGM_P text) {
+        size_t offset = 0;
+        for (size_t i = 0; char c = pgm_read_byte(text + i); i++) {
+            if (c == '\n')
+                offset = i + 1;
+        }
+        return offset;
+    }
+
+    void write_value(Print& out, const metric_t& metric) {
+        if (metric.kind == uint_value) {
+            out.print((unsigned long) *(const uint32_t*) metric.value);
+            return;
+        }
+
+        float value = *(const float*) metric.value;
+        if (isnan(value)) {
+            out.print("NaN");
+        } else if (isinf(value)) {
+            out.print(value > 0 ? "+Inf" : "-Inf");
+        } else {
+            out.print(value, PROM_VALUE_DIGITS);
+        }
+    }
+
+    void render(const registry_t& reg, Print& out) {
+        for (int i = 0; i < reg.num_metrics; i++) {
+            write_P(out, reg.metrics[i].text);
+            write_value(out, reg.metrics[i]);
+            out.write('\n');
+        }
+    }
+
+    /*
+     * Render several samples of every metric in one exposition, for pushing
+     * a batch. load(i) points the registered values at sample i and returns
+     * its time in seconds, or 0 to leave it without a timestamp.
+     */
+    void render_batch(const registry_t& reg, Print& out, int num_samples, uint32_t (*load)(int)) {
+        for (int i = 0; i < reg.num_metrics; i++) {
+            PGM_P text = reg.metrics[i].text;
+            size_t offset = series_offset(text);
+            write_P(out, text, offset);
+
+            for (int sample = 0; sample < num_samples; sample++) {
+                uint32_t time = load(sample);
+                write_P(out, text + offset);
+                write_value(out, reg.metrics[i]);
+                if (time) {
+                    // the text format wants milliseconds
+                    out.write(' ');
+                    out.print((unsigned long) time);
+                    out.print("000");
+                }
+                out.write('\n');
+            }
+        }
+    }
+
+    /*
+     * Binary snapshot, all little endian:
+     *
+     *   u8 version, u8 metric count, u32 schema id, u32 timestamp (s)
+     *   i32 per metric, in registry order
+     *
+     * Floats are fixed point with PROM_VALUE_DIGITS decimals and INT32_MIN
+     * for NaN (infinities saturate), counters are sent as is. The schema id
+     * is a hash of render_schema()'s output, so a collector only needs to
+     * refetch the schema when it changes.
+     */
+    const int binary_header_size = 10;
+    const int max_binary_size = binary_header_size + 4 * PROM_MAX_METRICS;
+
+    const int32_t binary_nan = INT32_MIN;
+
+    int32_t fixed_point(float value) {
+        const float scale = powf(10, PROM_VALUE_DIGITS);
+        if (isnan(value))
+            return binary_nan;
+
+        float scaled = value * scale;
+        if (scaled >= 2147483647.0f)
+            return INT32_MAX;
+        if (scaled <= -2147483647.0f)
+            return -INT32_MAX;
+        return lroundf(scaled);
+    }
+
+    uint8_t* put_u32(uint8_t* out, uint32_t v) {
+        for (int i = 0; i < 4; i++)
+            *out++ = v >> (8 * i);
+        return out;
+    }
+
+    /*
+     * One line per metric in snapshot order: the series with its labels,
+     * then how to read the value, "f<digits>" for fixed point and "u" for
+     * unsigned.
+     */
+    void render_schema(const registry_t& reg, Print& out) {
+        for (int i = 0; i < reg.num_metrics; i++) {
+            PGM_P text = reg.metrics[i].text;
+            PGM_P series = text + series_offset(text);
+            write_P(out, series);
+
+            if (reg.metrics[i].kind == uint_value) {
+                out.print('u');
+            } else {
+                out.print('f');
+                out.print(PROM_VALUE_DIGITS);
+            }
+            out.write('\n');
+        }
+    }
+
+    // FNV-1a of render_schema()'s output, without rendering it
+    uint32_t schema_id(const registry_t& reg) {
+        if (reg.schema_known)
+            return reg.schema;
+
+        struct hasher : public Print {
+            uint32_t hash = 2166136261UL;
+
+            size_t write(uint8_t c) override {
+                hash = (hash ^ c) * 16777619UL;
+                return 1;
+            }
+
+            using Print::write;
+        } hash;
+
+        render_schema(reg, hash);
+        reg.schema = hash.hash;
+        reg.schema_known = true;
+        return reg.schema;
+    }
+
+    /*
+     * Fill out, max_binary_size bytes, returning the length used.
+     */
+    int encode_binary(const registry_t& reg, uint32_t timestamp, uint8_t* out) {
+        uint8_t* p = out;
+        *p++ = PROM_BINARY_VERSION;
+        *p++ = reg.num_metrics;
+        p = put_u32(p, schema_id(reg));
+        p = put_u32(p, timestamp);
+
+        for (int i = 0; i < reg.num_metrics; i++) {
+            const metric_t& metric = reg.metrics[i];
+            if (metric.kind == uint_value) {
+                p = put_u32(p, *(const uint32_t*) metric.value);
+            } else {
+                p = put_u32(p, fixed_point(*(const float*) metric.value));
+            }
+        }
+        return p - out;
+    }
+}
@@ -0,0 +1,93 @@
+/*
+ * The last rendered body of a response, reused for as long as the data it
+ * was rendered from hasn't changed.
+ *
+ * The caller names the data's version with a generation counter (e.g.
+ * Sampler::publish). A body is captured while it's first sent, through a
+ * tee_writer, and served as is until the generation moves on. The ETag is
+ * the generation together with the render time, so it doesn't repeat
+ * across reboots when the generation starts over.
+ */
+#include <Arduino.h>
+
+#ifndef RESPONSE_CACHE_SIZE
+#define RESPONSE_CACHE_SIZE 2048
+#endif
+
+namespace ResponseCache {
+    struct cache_t {
+        uint32_t generation = 0;
+        unsigned long rendered_at = 0;
+        bool rendered = false;
+        // false when the last render didn't fit in body
+        bool complete = false;
+        int len = 0;
+        char body[RESPONSE_CACHE_SIZE];
+    };
+
+    /*
+     * Writes to the response and the cache at once. The cache is dropped
+     * if the body outgrows it, the response carries on regardless.
+     */
+    class tee_writer : public Print {
+        Print& out;
+        cache_t& cache;
+
+    public:
+        tee_writer(Print& out, cache_t& cache) : out(out), cache(cache) {}
+
+        size_t write(uint8_t c) override {
+            return write(&c, 1);
+        }
+
+        size_t write(const uint8_t* data, size_t len) override {
+            if (cache.complete) {
+                if (cache.len + len <= sizeof(cache.body)) {
+                    memcpy(cache.body + cache.len, data, len);
+                    cache.len += len;
+                } else {
+                    cache.complete = false;
+                }
+            }
+            return out.write(data, len);
+        }
+
+        using Print::write;
+    };
+
+    bool is_fresh(const cache_t& cache, uint32_t generation) {
+        return cache.rendered && cache.generation == generation;
+    }
+
+    /*
+     * Start capturing a new render for generation. A body too big to keep
+     * is rendered again each time, but keeps its ETag until the data changes.
+     */
+    void begin_render(cache_t& cache, uint32_t generation) {
+        if (!is_fresh(cache, generation))
+            cache.rendered_at = millis();
+
+        cache.generation = generation;
+        cache.rendered = true;
+        cache.complete = true;
+        cache.len = 0;
+    }
+
+    // quoted, as it goes in the header
+    void format_etag(const cache_t& cache, char (&etag)[24]) {
+        snprintf(etag, sizeof(etag), "\"%lx-%lx\"", (unsigned long) cache.generation, cache.rendered_at);
+    }
+
+    /*
+     * Whether an If-None-Match value names etag. The value may be a list,
+     * and weak tags match too since the body never changes encoding.
+     */
+    bool etag_matches(const char* if_none_match, int len, const char* etag) {
+        int etag_len = strlen(etag);
+        for (int i = 0; i + etag_len <= len; i++) {
+            if (!memcmp(if_none_match + i, etag, etag_len))
+                return true;
+        }
+        return len == 1 && if_none_match[0] == '*';
+    }
+}
@@ -0,0 +1,171 @@
+/*
+ * Cooperative sensor sampling, driven from loop().
+ *
+ * Each task samples one sensor on its own period into a scratch copy of its
+ * value and only copies it over the published value when the read succeeds,
+ * so handlers always see the last good reading and never touch a sensor:
+ *
+ *   static Sampler::scheduler_t sampler;
+ *   Sampler::add_task(sampler, &sample_dht, &reading.dht, 2000);
+ *   ...
+ *   Sampler::run(sampler);    // in loop()
+ *
+ * Tasks run one per call to run(), so the worst stall loop() sees is one
+ * sensor read, not all of them. A task reading asynchronously returns
+ * sample_pending and is polled on every run() until it finishes, alongside
+ * the other tasks, so polls have to be cheap.
+ */
+#include <Arduino.h>
+
+#ifndef SAMPLER_MAX_TASKS
+#define SAMPLER_MAX_TASKS 8
+#endif
+
+namespace Sampler {
+    enum sample_status : uint8_t {
+        sample_ok,
+        sample_failed,
+        sample_pending
+    };
+
+    struct task_t;
+    typedef sample_status (*run_func_t)(task_t&);
+
+    struct task_t {
+        run_func_t run;
+        void (*sample)();  // sample_status(*)(T&), type erased
+        void* value;
+        unsigned long period;
+        unsigned long next_due;
+        unsigned long last_success;
+        bool has_value;
+        bool pending;
+        uint32_t samples;
+        uint32_t errors;
+        float age;  // seconds since last_success, see update_ages
+    };
+
+    struct scheduler_t {
+        int num_tasks = 0;
+        // bumped whenever any task finishes a sample, good or not
+        uint32_t generation = 0;
+        // see publish
+        uint32_t published = 0;
+        uint32_t published_generation = 0;
+        unsigned long published_at = 0;
+        task_t tasks[SAMPLER_MAX_TASKS];
+    };
+
+    template<typename T>
+    sample_status run_task(task_t& task) {
+        T scratch = *(T*) task.value;
+        sample_status status = ((sample_status(*)(T&)) task.sample)(scratch);
+
+        if (status == sample_ok)
+            *(T*) task.value = scratch;
+
+        return status;
+    }
+
+    /*
+     * Sample into *value every period ms. Returns the task so its counters
+     * can be exported, or nullptr when the table is full.
+     */
+    template<typename T>
+    task_t* add_task(scheduler_t& sched, sample_status (*sample)(T&), T* value, unsigned long period) {
+        if (sched.num_tasks >= SAMPLER_MAX_TASKS)
+            return nullptr;
+
+        task_t& task = sched.tasks[sched.num_tasks++];
+        task = task_t{};
+        task.run = &run_task<T>;
+        task.sample = (void(*)()) sample;
+        task.value = value;
+        task.period = period;
+        task.next_due = millis();
+        task.age = NAN;
+        return &task;
+    }
+
+    bool is_due(const task_t& task, unsigned long now) {
+        return (long) (now - task.next_due) >= 0;
+    }
+
+    void run_one(scheduler_t& sched, task_t& task) {
+        sample_status status = task.run(task);
+        task.pending = status == sample_pending;
+        if (task.pending)
+            return;
+
+        unsigned long now = millis();
+
+        task.samples++;
+        sched.generation++;
+        if (status == sample_ok) {
+            task.last_success = now;
+            task.has_value = true;
+        } else {
+            task.errors++;
+        }
+
+        task.next_due += task.period;
+        // don't try to catch up on periods missed while blocked
+        if (is_due(task, now))
+            task.next_due = now + task.period;
+    }
+
+    /*
+     * Poll the pending tasks, then start the most overdue task if any is due.
+     */
+    void run(scheduler_t& sched) {
+        unsigned long now = millis();
+        task_t* next = nullptr;
+
+        for (int i = 0; i < sched.num_tasks; i++) {
+            task_t& task = sched.tasks[i];
+            if (task.pending) {
+                run_one(sched, task);
+                continue;
+            }
+            if (!is_due(task, now))
+                continue;
+
+            if (!next || (long) (task.next_due - next->next_due) < 0)
+                next = &task;
+        }
+
+        if (next)
+            run_one(sched, *next);
+    }
+
+    /*
+     * A coarse version of everything the tasks export, values, ages and
+     * error counts alike, for keying caches on. It moves on at most once
+     * per period, and only when a sample finished since it last did, so a
+     * fast task doesn't invalidate a cache on every read.
+     */
+    uint32_t publish(scheduler_t& sched, unsigned long period) {
+        unsigned long now = millis();
+        if (sched.generation == sched.published_generation)
+            return sched.published;
+
+        if (sched.published == 0 || now - sched.published_at >= period) {
+            sched.published++;
+            sched.published_generation = sched.generation;
+            sched.published_at = now;
+        }
+        return sched.published;
+    }
+
+    /*
+     * Refresh each task's age in seconds, NaN until its first good sample.
+     */
+    void update_ages(scheduler_t& sched) {
+        unsigned long now = millis();
+
+        for (int i = 0; i < sched.num_tasks; i++) {
+            task_t& task = sched.tasks[i];
+            task.age = task.has_value ? (now - task.last_success) / 1000.0f : NAN;
+        }
+    }
+}
@@ -0,0 +1,206 @@
+/*
+ * Non blocking WiFi bring-up for the ESP8266 that remembers the last
+ * association.
+ *
+ * Once connected, the AP's BSSID and channel are saved to RTC memory, which
+ * survives resets and deep sleep, and to flash, which survives power loss.
+ * The next boot joins that AP directly on that channel, skipping the scan.
+ * If the cached join doesn't connect within WIFI_FAST_TIMEOUT_MS at boot,
+ * the saved settings are dropped and it falls back to a full scan.
+ *
+ * DHCP is not skipped. Reusing the last lease as a static address would
+ * need it checked against the lease time, which the Arduino core doesn't
+ * expose, or against the gateway. Unchecked, a board keeps an address the
+ * router may have handed to someone else, so every join still asks DHCP.
+ *
+ *   WifiFast::begin(WIFI_SSID, WIFI_PASS);
+ *   ...
+ *   if (WifiFast::run())    // in loop(), true once the link comes up
+ *       Serial.println(WiFi.localIP());
+ */
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <EEPROM.h>
+
+#ifndef WIFI_FAST_TIMEOUT_MS
+#define WIFI_FAST_TIMEOUT_MS 4000
+#endif
+
+// in 4 byte blocks, clear of anything else kept in RTC memory
+#ifndef WIFI_FAST_RTC_OFFSET
+#define WIFI_FAST_RTC_OFFSET 0
+#endif
+
+// set to 0 to keep the association in RTC memory only
+#ifndef WIFI_FAST_FLASH
+#define WIFI_FAST_FLASH 1
+#endif
+
+#ifndef WIFI_FAST_EEPROM_OFFSET
+#define WIFI_FAST_EEPROM_OFFSET 0
+#endif
+
+namespace WifiFast {
+    enum state_t : uint8_t {
+        connecting_cached,
+        connecting,
+        connected
+    };
+
+    struct association_t {
+        uint32_t crc;
+        uint8_t bssid[6];
+        uint8_t channel;
+        uint8_t reserved;
+    };
+
+    static_assert(sizeof(association_t) % 4 == 0, "RTC memory is read in 4 byte blocks");
+
+    static const char* ssid;
+    static const char* pass;
+    static association_t saved;
+    static bool has_saved = false;
+    static state_t state = connecting;
+    // the last join was pinned to the saved BSSID
+    static bool pinned = false;
+    static unsigned long started;
+
+    uint32_t crc32(const uint8_t* data, size_t len) {
+        uint32_t crc = 0xFFFFFFFF;
+        for (size_t i = 0; i < len; i++) {
+            crc ^= data[i];
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+        return ~crc;
+    }
+
+    uint32_t checksum(const association_t& assoc) {
+        return crc32((const uint8_t*) &assoc + sizeof(assoc.crc), sizeof(assoc) - sizeof(assoc.crc));
+    }
+
+    bool valid(const association_t& assoc) {
+        return assoc.crc == checksum(assoc) && assoc.channel;
+    }
+
+    bool load(association_t& assoc) {
+        if (ESP.rtcUserMemoryRead(WIFI_FAST_RTC_OFFSET, (uint32_t*) &assoc, sizeof(assoc)) && valid(assoc))
+            return true;
+
+#if WIFI_FAST_FLASH
+        EEPROM.begin(WIFI_FAST_EEPROM_OFFSET + sizeof(assoc));
+        EEPROM.get(WIFI_FAST_EEPROM_OFFSET, assoc);
+        EEPROM.end();
+        if (valid(assoc)) {
+            ESP.rtcUserMemoryWrite(WIFI_FAST_RTC_OFFSET, (uint32_t*) &assoc, sizeof(assoc));
+            return true;
+        }
+#endif
+        return false;
+    }
+
+    /*
+     * Only touches flash when the association changed, so an unchanged
+     * reconnect costs no erase cycle.
+     */
+    void store(const association_t& assoc) {
+        if (has_saved && !memcmp(&saved, &assoc, sizeof(assoc)))
+            return;
+
+        ESP.rtcUserMemoryWrite(WIFI_FAST_RTC_OFFSET, (uint32_t*) &assoc, sizeof(assoc));
+#if WIFI_FAST_FLASH
+        EEPROM.begin(WIFI_FAST_EEPROM_OFFSET + sizeof(assoc));
+        EEPROM.put(WIFI_FAST_EEPROM_OFFSET, assoc);
+        EEPROM.commit();
+        EEPROM.end();
+#endif
+        saved = assoc;
+        has_saved = true;
+    }
+
+    void forget() {
+        association_t none;
+        memset(&none, 0, sizeof(none));
+        store(none);
+        has_saved = false;
+    }
+
+    void connect_cached() {
+        // all zeros keeps the station on DHCP
+        WiFi.config(0u, 0u, 0u);
+        WiFi.begin(ssid, pass, saved.channel, saved.bssid, true);
+        state = connecting_cached;
+        pinned = true;
+        started = millis();
+    }
+
+    void connect_scan() {
+        WiFi.config(0u, 0u, 0u);
+        WiFi.begin(ssid, pass);
+        state = connecting;
+        pinned = false;
+        started = millis();
+    }
+
+    /*
+     * Starts connecting and returns straight away.
+     */
+    void begin(const char* wifi_ssid, const char* wifi_pass) {
+        ssid = wifi_ssid;
+        pass = wifi_pass;
+
+        // the settings are passed on every boot, don't rewrite them to flash
+        WiFi.persistent(false);
+        WiFi.mode(WIFI_STA);
+
+        has_saved = load(saved);
+        if (has_saved)
+            connect_cached();
+        else
+            connect_scan();
+    }
+
+    bool is_connected() {
+        return state == connected;
+    }
+
+    /*
+     * Returns true on the call where the connection comes up.
+     */
+    bool run() {
+        bool up = WiFi.status() == WL_CONNECTED;
+
+        if (state != connected && up) {
+            association_t assoc;
+            memset(&assoc, 0, sizeof(assoc));
+            memcpy(assoc.bssid, WiFi.BSSID(), sizeof(assoc.bssid));
+            assoc.channel = WiFi.channel();
+            assoc.crc = checksum(assoc);
+            store(assoc);
+
+            state = connected;
+            return true;
+        }
+
+        if (state == connected && !up) {
+            // the SDK reconnects on its own, give it the same grace period
+            state = connecting;
+            started = millis();
+        }
+
+        if (state != connected && millis() - started > WIFI_FAST_TIMEOUT_MS) {
+            if (state == connecting_cached) {
+                // the saved AP is gone, don't try it again next boot
+                forget();
+                connect_scan();
+            } else if (pinned) {
+                // an outage while pinned to the saved AP, which may have
+                // moved. The cache is only rewritten if the scan finds
+                // another one.
+                connect_scan();
+            }
+        }
+
+        return false;
+    }
+}